@@ -15,20 +15,45 @@
  */
 C_CLASS_DECL(IBHashTable);
 
+/** Case mappings for comparing keys.
+ * These are the case mappings IRC servers announce with the CASEMAPPING
+ * ISUPPORT token.
+ * @class IBCaseMapping hashtable.h <ircbot/hashtable.h>
+ * @enum IBCaseMapping hashtable.h <ircbot/hashtable.h>
+ */
+typedef enum IBCaseMapping
+{
+    IBCM_NONE,		/**< case-sensitive */
+    IBCM_ASCII,		/**< A-Z are equal to a-z */
+    IBCM_RFC1459,	/**< like IBCM_ASCII, and []\^ equal to {}|~ */
+    IBCM_STRICTRFC1459	/**< like IBCM_ASCII, and []\ equal to {}| */
+} IBCaseMapping;
+
 /** An iterator over the contents of an IBHashTable.
  * @class IBHashTableIterator hashtable.h <ircbot/hashtable.h>
  */
 C_CLASS_DECL(IBHashTableIterator);
 
 /** IBHashTable default constructor.
- * Creates a new IBHashTable
+ * Creates a new IBHashTable. The table grows and shrinks with the number of
+ * entries, but never below the initial size.
  * @memberof IBHashTable
- * @param bits number of bits for the hashes (valid range [2..8])
+ * @param bits initial size as a power of 2 (valid range [2..8])
  * @returns a newly created IBHashTable
  */
 DECLEXPORT IBHashTable *IBHashTable_create(uint8_t bits)
     ATTR_RETNONNULL;
 
+/** Set the case mapping for comparing keys.
+ * The default is IBCM_NONE. When keys become equal under the new case
+ * mapping, only one of them is kept, the others are deleted.
+ * @memberof IBHashTable
+ * @param self the IBHashTable
+ * @param mapping the case mapping
+ */
+DECLEXPORT void IBHashTable_setCaseMapping(IBHashTable *self,
+	IBCaseMapping mapping) CMETHOD;
+
 /** Set a new object for a key.
  * If there was already an object for the given key, it is replaced. The old
  * object is destroyed if it has a deleter attached.
@@ -0,0 +1,64 @@
+#ifndef IRCBOT_IRCBATCH_H
+#define IRCBOT_IRCBATCH_H
+
+#include <ircbot/decl.h>
+
+#include <stddef.h>
+
+/** declarations for the IrcBatch class
+ * @file
+ */
+
+/** A batch of IRC messages the server sent as one unit (IRCv3 batch).
+ * Messages of nested batches are included in the outermost batch, together
+ * with the BATCH messages opening and closing the nested batches.
+ * @class IrcBatch ircbatch.h <ircbot/ircbatch.h>
+ */
+C_CLASS_DECL(IrcBatch);
+
+C_CLASS_DECL(IrcMessage);
+
+/** The type of the batch.
+ * @memberof IrcBatch
+ * @param self the IrcBatch
+ * @returns the type, e.g. "netsplit" or "chathistory"
+ */
+DECLEXPORT const char *IrcBatch_type(const IrcBatch *self)
+    CMETHOD ATTR_RETNONNULL ATTR_PURE;
+
+/** The number of parameters of the batch.
+ * These are the parameters following the type.
+ * @memberof IrcBatch
+ * @param self the IrcBatch
+ * @returns the number of parameters
+ */
+DECLEXPORT size_t IrcBatch_paramCount(const IrcBatch *self)
+    CMETHOD ATTR_PURE;
+
+/** A single parameter of the batch.
+ * @memberof IrcBatch
+ * @param self the IrcBatch
+ * @param i the index of the parameter
+ * @returns the parameter, or NULL if there is no parameter at this index
+ */
+DECLEXPORT const char *IrcBatch_param(const IrcBatch *self, size_t i)
+    CMETHOD ATTR_PURE;
+
+/** The number of messages in the batch.
+ * @memberof IrcBatch
+ * @param self the IrcBatch
+ * @returns the number of messages
+ */
+DECLEXPORT size_t IrcBatch_messageCount(const IrcBatch *self)
+    CMETHOD ATTR_PURE;
+
+/** A single message of the batch.
+ * @memberof IrcBatch
+ * @param self the IrcBatch
+ * @param i the index of the message, in the order they were received
+ * @returns the message, or NULL if there is no message at this index
+ */
+DECLEXPORT const IrcMessage *IrcBatch_message(const IrcBatch *self, size_t i)
+    CMETHOD ATTR_PURE;
+
+#endif
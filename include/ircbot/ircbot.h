@@ -3,6 +3,8 @@
 
 #include <ircbot/decl.h>
 
+#include <stddef.h>
+
 /** declarations for the main IrcBot API and related classes
  * @file
  */
@@ -21,6 +23,7 @@ C_CLASS_DECL(IrcBotEvent);
  */
 C_CLASS_DECL(IrcBotResponse);
 
+C_CLASS_DECL(IrcBatch);
 C_CLASS_DECL(IrcChannel);
 C_CLASS_DECL(IrcServer);
 
@@ -39,15 +42,53 @@ typedef enum IrcBotEventType
     IBET_CONNECTED,	/**< Connected to IRC server */
     IBET_CHANJOINED,	/**< Channel joined by bot */
     IBET_JOINED,	/**< Channel joined by other user */
-    IBET_PARTED		/**< Channel left by other user */
+    IBET_PARTED,	/**< Channel left by other user */
+    IBET_BATCH		/**< A complete batch of messages (IRCv3) */
 } IrcBotEventType;
 
+/** What the thread pool does with a new job when its queue is full.
+ * @enum IBOverloadPolicy ircbot.h <ircbot/ircbot.h>
+ */
+typedef enum IBOverloadPolicy
+{
+    IBOP_REJECT,	/**< Reject the job, see IBThreadOpts_setRejectHandler() */
+    IBOP_GROW,		/**< Queue the job anyway, the queue grows as needed */
+    IBOP_BLOCK,		/**< Wait until the queue has room again, a worker
+			     thread runs the job itself instead. The main
+			     thread waits at most 200ms, so the event loop
+			     keeps running and can time out hung jobs, then
+			     queues the job anyway like IBOP_GROW until the
+			     queue has drained */
+    IBOP_COALESCE	/**< Drop a bot event identical to one that is still
+			     waiting, reject other jobs when the queue is full */
+} IBOverloadPolicy;
+
+/** Counters of the integrated thread pool.
+ * @struct IBThreadStats ircbot.h <ircbot/ircbot.h>
+ */
+typedef struct IBThreadStats
+{
+    unsigned long queued;	/**< jobs accepted */
+    unsigned long rejected;	/**< jobs rejected because of a full queue */
+    unsigned long coalesced;	/**< jobs dropped as duplicates */
+    unsigned long blocked;	/**< times a caller waited for room */
+    unsigned long ranInline;	/**< jobs run by the submitting worker */
+    unsigned long overflowed;	/**< jobs queued beyond the queue size */
+    unsigned long overflowLen;	/**< jobs currently beyond the queue size */
+    unsigned long maxOverflowLen; /**< maximum of overflowLen */
+} IBThreadStats;
+
 /** Handler for a bot event.
  * Will be executed on a worker thread.
  * @param event the event to handle
  */
 typedef void (*IrcBotHandler)(IrcBotEvent *event) ATTR_NONNULL((1));
 
+/** A child job started by a handler.
+ * @param arg the argument given to IrcBotEvent_spawn()
+ */
+typedef void (*IrcBotJobProc)(void *arg);
+
 #define ORIGIN_PRIVATE ":" /**< the origin is any private message */
 #define ORIGIN_CHANNEL "#" /**< the origin is any channel */
 
@@ -134,6 +175,45 @@ DECLEXPORT void IBThreadOpts_setMinQueueLen(IBThreadOpts *self, int num)
 DECLEXPORT void IBThreadOpts_setQLenPerThread(IBThreadOpts *self, int num)
     CMETHOD;
 
+/** Enable the work-stealing scheduler.
+ * With work stealing, every worker thread has its own queue for jobs it
+ * creates itself, e.g. child jobs of a handler, and idle workers steal
+ * jobs from the queues of busy ones.
+ * Default: 0 (disabled).
+ * @memberof IBThreadOpts
+ * @param self the IBThreadOpts
+ * @param enable 1 to enable work stealing, 0 to disable it
+ */
+DECLEXPORT void IBThreadOpts_setWorkStealing(IBThreadOpts *self, int enable)
+    CMETHOD;
+
+/** Set what to do with new jobs when the queue is full.
+ * Default: IBOP_REJECT.
+ * @memberof IBThreadOpts
+ * @param self the IBThreadOpts
+ * @param policy the overload policy
+ */
+DECLEXPORT void IBThreadOpts_setOverloadPolicy(IBThreadOpts *self,
+	IBOverloadPolicy policy) CMETHOD;
+
+/** Set a handler for bot events rejected because of overload.
+ * The handler is called on the main thread instead of the handler that
+ * was rejected. It can add responses, e.g. to tell the user to try again
+ * later, so it should return quickly.
+ * Default: NULL (none).
+ * @memberof IBThreadOpts
+ * @param self the IBThreadOpts
+ * @param handler the handler for rejected events, or NULL for none
+ */
+DECLEXPORT void IBThreadOpts_setRejectHandler(IBThreadOpts *self,
+	IrcBotHandler handler) CMETHOD;
+
+/** Obtain the current counters of the thread pool.
+ * @memberof IrcBot
+ * @param stats where to store the counters
+ */
+DECLEXPORT void IrcBot_threadStats(IBThreadStats *stats) ATTR_NONNULL((1));
+
 /** Request the bot to deamonize first when running.
  * If a pidfile is given, it is also used to check for an already running
  * instance.
@@ -176,7 +256,8 @@ DECLEXPORT void IrcBot_shutdown(void (*shutdown)(void));
  *               for any channel, or ORIGIN_PRIVATE for any message received
  *               privately, or NULL for any message
  * @param filter an additional filter depending on the eventType, e.g. the
- *               command for IBET_BOTCOMMAND, or NULL for any
+ *               command for IBET_BOTCOMMAND or the batch type for
+ *               IBET_BATCH, or NULL for any
  * @param handler the handler to execute for the event
  */
 DECLEXPORT void IrcBot_addHandler(IrcBotEventType eventType,
@@ -253,6 +334,16 @@ DECLEXPORT const char *IrcBotEvent_from(const IrcBotEvent *self) CMETHOD;
  */
 DECLEXPORT const char *IrcBotEvent_arg(const IrcBotEvent *self) CMETHOD;
 
+/** The batch of an IBET_BATCH event.
+ * Unless the batch holds history like "chathistory", its messages were
+ * already handled one by one as well.
+ * @memberof IrcBotEvent
+ * @param self the IrcBotEvent
+ * @returns the batch, or NULL if this is not a batch event
+ */
+DECLEXPORT const IrcBatch *IrcBotEvent_batch(const IrcBotEvent *self)
+    CMETHOD;
+
 /** Obtain a response object to configure.
  * @memberof IrcBotEvent
  * @param self the IrcBotEvent
@@ -261,6 +352,29 @@ DECLEXPORT const char *IrcBotEvent_arg(const IrcBotEvent *self) CMETHOD;
 DECLEXPORT IrcBotResponse *IrcBotEvent_response(IrcBotEvent *self)
     CMETHOD ATTR_RETNONNULL;
 
+/** Run a child job for the handler of this event.
+ * This allows a handler to split its work, e.g. to fetch several things
+ * in parallel. With work stealing enabled, the job is queued and can be
+ * picked up by idle worker threads, otherwise it runs immediately on the
+ * calling thread. Child jobs must not use the IrcBotResponse, the handler
+ * should add responses after IrcBotEvent_sync(). When the handler returns,
+ * all its child jobs are waited for.
+ * @memberof IrcBotEvent
+ * @param self the IrcBotEvent
+ * @param proc the function to run
+ * @param arg argument passed to the function
+ */
+DECLEXPORT void IrcBotEvent_spawn(IrcBotEvent *self,
+	IrcBotJobProc proc, void *arg)
+    CMETHOD ATTR_NONNULL((2));
+
+/** Wait for all child jobs of this event to complete.
+ * While waiting, the calling thread runs queued jobs itself.
+ * @memberof IrcBotEvent
+ * @param self the IrcBotEvent
+ */
+DECLEXPORT void IrcBotEvent_sync(IrcBotEvent *self) CMETHOD;
+
 /** Add a message to a bot response.
  * @memberof IrcBotResponse
  * @param self the IrcBotResponse
@@ -272,4 +386,20 @@ DECLEXPORT void IrcBotResponse_addMsg(IrcBotResponse *self,
 	const char *to, const char *msg, int action)
     CMETHOD ATTR_NONNULL((2)) ATTR_NONNULL((3));
 
+/** Add a message for several recipients to a bot response.
+ * Recipients are combined into a single line as far as the server allows
+ * (TARGMAX). Long messages are split into several lines, preferably at word
+ * boundaries and never inside of an UTF-8 sequence, leaving room for the
+ * prefix the server adds when relaying them.
+ * @memberof IrcBotResponse
+ * @param self the IrcBotResponse
+ * @param to channels or nicks to send the message to
+ * @param nto number of entries in to
+ * @param msg the message to send
+ * @param action 0 for a normal message, 1 for an ACTION (like /me command)
+ */
+DECLEXPORT void IrcBotResponse_addMultiMsg(IrcBotResponse *self,
+	const char *const *to, size_t nto, const char *msg, int action)
+    CMETHOD ATTR_NONNULL((2)) ATTR_NONNULL((4));
+
 #endif
@@ -67,6 +67,10 @@ typedef enum IrcCommand
     MSG_USERHOST    = 143,
     MSG_ISON	    = 144,
 
+    /* IRCv3 extensions */
+    MSG_CAP	    = 145,
+    MSG_IRCBATCH    = 146,	/* BATCH, MSG_BATCH is taken by <sys/socket.h> */
+
     RPL_TRACELINK	= 200,
     RPL_TRACECONNECTING	= 201,
     RPL_TRACEHANDSHAKE	= 202,
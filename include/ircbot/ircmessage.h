@@ -4,6 +4,9 @@
 #include <ircbot/decl.h>
 #include <ircbot/irccommand.h>
 
+#include <stddef.h>
+#include <stdint.h>
+
 /** declarations for the IrcMessage class
  * @file
  */
@@ -15,6 +18,28 @@ C_CLASS_DECL(IrcMessage);
 
 C_CLASS_DECL(IBList);
 
+/** The value of a message tag.
+ * Message tags are an IRCv3 extension, the server only sends them after
+ * they were negotiated. Escaped characters in the value are already
+ * replaced.
+ * @memberof IrcMessage
+ * @param self the IrcMessage
+ * @param key the name of the tag, e.g. "time"
+ * @returns the value, an empty string if the tag has no value, or NULL if
+ *     the tag is not present
+ */
+DECLEXPORT const char *IrcMessage_tag(const IrcMessage *self, const char *key)
+    CMETHOD ATTR_NONNULL((2)) ATTR_PURE;
+
+/** The time the server received the message.
+ * This is taken from the IRCv3 server-time tag.
+ * @memberof IrcMessage
+ * @param self the IrcMessage
+ * @returns milliseconds since the epoch, or 0 if the time is unknown
+ */
+DECLEXPORT uint64_t IrcMessage_time(const IrcMessage *self)
+    CMETHOD ATTR_PURE;
+
 /** The prefix of the message.
  * @memberof IrcMessage
  * @param self the IrcMessage
@@ -39,6 +64,24 @@ DECLEXPORT IrcCommand IrcMessage_command(const IrcMessage *self)
 DECLEXPORT const char *IrcMessage_rawCmd(const IrcMessage *self)
     CMETHOD ATTR_RETNONNULL ATTR_PURE;
 
+/** The number of parameters of the message.
+ * @memberof IrcMessage
+ * @param self the IrcMessage
+ * @returns the number of parameters
+ */
+DECLEXPORT size_t IrcMessage_paramCount(const IrcMessage *self)
+    CMETHOD ATTR_PURE;
+
+/** A single parameter of the message.
+ * Unlike IrcMessage_params(), this doesn't need to build a list.
+ * @memberof IrcMessage
+ * @param self the IrcMessage
+ * @param i the index of the parameter
+ * @returns the parameter, or NULL if there is no parameter at this index
+ */
+DECLEXPORT const char *IrcMessage_param(const IrcMessage *self, size_t i)
+    CMETHOD ATTR_PURE;
+
 /** The parameters of the message.
  * @memberof IrcMessage
  * @param self the IrcMessage
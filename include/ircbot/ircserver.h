@@ -3,6 +3,8 @@
 
 #include <ircbot/decl.h>
 
+#include <stddef.h>
+
 /** declarations for the IrcServer class
  * @file
  */
@@ -15,6 +17,16 @@ C_CLASS_DECL(IrcChannel);
  */
 C_CLASS_DECL(IrcServer);
 
+/** Counters of the queue of lines waiting to be sent to a server.
+ * @struct IBSendStats ircserver.h <ircbot/ircserver.h>
+ */
+typedef struct IBSendStats
+{
+    unsigned long queued;	/**< bytes currently queued */
+    unsigned long maxQueued;	/**< maximum of queued */
+    unsigned long allocFailed;	/**< lines dropped because the queue was full */
+} IBSendStats;
+
 /** Create a new IRC server to connect to.
  * @memberof IrcServer
  * @param id an identifier for the server, e.g. the name of the IRC network
@@ -57,6 +69,37 @@ DECLEXPORT void IrcServer_useIpv4(IrcServer *self) CMETHOD;
  */
 DECLEXPORT void IrcServer_useIpv6(IrcServer *self) CMETHOD;
 
+/** Set the maximum length of lines received from the server.
+ * Longer lines are discarded and logged as a protocol error. The default is
+ * 8191 bytes, enough for IRCv3 message tags. Values are clamped to the range
+ * from 510 (the RFC 1459 limit) to 65536. This function must be called
+ * before the IrcServer object is passed to the IrcBot.
+ * @memberof IrcServer
+ * @param self the IrcServer
+ * @param len the maximum line length in bytes, not counting CR/LF
+ */
+DECLEXPORT void IrcServer_setMaxLineLength(IrcServer *self, size_t len)
+    CMETHOD;
+
+/** Set the rate limit for lines sent to the server.
+ * Lines are sent at a sustained rate of one line per msPerLine
+ * milliseconds, allowing bursts of up to burst lines after an idle period.
+ * Only PING/PONG and the lines sent while logging in are never held back,
+ * but they count against the limit. Other commands and messages are sent
+ * round-robin between their targets, so a long message to one target
+ * doesn't delay replies to others, while lines to the same target keep
+ * their order. QUIT is sent after all other queued lines. The default is a
+ * burst of 4 lines and one line every 2000 milliseconds.
+ * @memberof IrcServer
+ * @param self the IrcServer
+ * @param burst the maximum number of lines sent in a burst
+ * @param msPerLine the interval between lines in milliseconds, 0 disables
+ *     rate limiting
+ */
+DECLEXPORT void IrcServer_setSendRate(IrcServer *self,
+	unsigned burst, unsigned msPerLine)
+    CMETHOD;
+
 /** The identifier of the server.
  * @memberof IrcServer
  * @param self the IrcServer
@@ -92,6 +135,16 @@ DECLEXPORT const char *IrcServer_nick(const IrcServer *self)
 DECLEXPORT const IBHashTable *IrcServer_channels(const IrcServer *self)
     CMETHOD;
 
+/** Get counters of the send queue.
+ * Up to 1024 lines can wait to be sent, messages beyond that are dropped.
+ * Protocol control lines are always queued.
+ * @memberof IrcServer
+ * @param self the IrcServer
+ * @param stats where to store the counters
+ */
+DECLEXPORT void IrcServer_sendStats(const IrcServer *self, IBSendStats *stats)
+    CMETHOD ATTR_NONNULL((2));
+
 /** Request to join a channel.
  * Do NOT use this function from bot event handlers!
  * @memberof IrcServer
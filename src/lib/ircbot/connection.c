@@ -16,6 +16,7 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #ifdef WITH_TLS
@@ -23,9 +24,10 @@
 #endif
 
 #define CONNBUFSZ 4096
+#define CONNBUFMAX 65536
 #define NWRITERECS 16
-#define CONNTICKS 6
-#define RESOLVTICKS 6
+#define CONNTIMEOUT 6000
+#define RESOLVTIMEOUT 6000
 
 static char hostbuf[NI_MAXHOST];
 static char servbuf[NI_MAXSERV];
@@ -61,6 +63,11 @@ typedef struct Connection
     Event *dataReceived;
     Event *dataSent;
     ThreadJob *resolveJob;
+    Timer *connectTimer;
+    EventHandle readHandle;
+    EventHandle writeHandle;
+    EventHandle deleteHandle;
+    EventHandle resolveHandle;
 #ifdef WITH_TLS
     SSL *tls;
 #endif
@@ -68,35 +75,46 @@ typedef struct Connection
     char *name;
     void *data;
     void (*deleter)(void *);
+    uint8_t *rdbuf;
+    size_t rdbufsz;
+    size_t rdbufpos;
+    size_t rdbuflen;
+    size_t rdbufmax;
     WriteRecord writerecs[NWRITERECS];
     DataReceivedEventArgs args;
     RemoteAddrResolveArgs resolveArgs;
     int fd;
     int connecting;
 #ifdef WITH_TLS
+    uint8_t *tls_wrbuf;
+    size_t tls_wrbuflen;
+    size_t tls_wrbufcapa;
     int tls_connect_st;
-    int tls_connect_ticks;
     int tls_read_st;
     int tls_write_st;
 #endif
     uint8_t deleteScheduled;
     uint8_t nrecs;
     uint8_t baserecidx;
-    uint8_t rdbuf[CONNBUFSZ];
 } Connection;
 
 void Connection_blacklistAddress(socklen_t len, struct sockaddr *addr)
     ATTR_NONNULL((2));
 
-static void checkPendingConnection(void *receiver, void *sender, void *args);
+static void connectTimeout(void *receiver, Timer *timer);
 static void wantreadwrite(Connection *self) CMETHOD;
 #ifdef WITH_TLS
-static void checkPendingTls(void *receiver, void *sender, void *args);
+static void tlsConnectTimeout(void *receiver, Timer *timer);
 static void dohandshake(Connection *self) CMETHOD;
 #endif
+static int completeWrite(Connection *self, size_t written, void **ids)
+    CMETHOD;
 static void dowrite(Connection *self) CMETHOD;
 static void deleteConnection(void *receiver, void *sender, void *args);
 static void deleteLater(Connection *self);
+static uint8_t *readBuffer(Connection *self, size_t *avail)
+    CMETHOD ATTR_NONNULL((2));
+static void dataRead(Connection *self, size_t size) CMETHOD;
 static void doread(Connection *self) CMETHOD;
 static void readConnection(void *receiver, void *sender, void *args);
 static void resolveRemoteAddrFinished(
@@ -104,19 +122,17 @@ static void resolveRemoteAddrFinished(
 static void resolveRemoteAddrProc(void *arg);
 static void writeConnection(void *receiver, void *sender, void *args);
 
-static void checkPendingConnection(void *receiver, void *sender, void *args)
+static void connectTimeout(void *receiver, Timer *timer)
 {
-    (void)sender;
-    (void)args;
+    (void)timer;
 
     Connection *self = receiver;
-    if (self->connecting && !--self->connecting)
-    {
-	IBLog_fmt(L_INFO, "connection: timeout connecting to %s",
-		Connection_remoteAddr(self));
-	Service_unregisterWrite(self->fd);
-	Connection_close(self, 1);
-    }
+    self->connectTimer = 0;
+    self->connecting = 0;
+    IBLog_fmt(L_INFO, "connection: timeout connecting to %s",
+	    Connection_remoteAddr(self));
+    Service_unregisterWrite(self->fd);
+    Connection_close(self, 1);
 }
 
 static void wantreadwrite(Connection *self)
@@ -153,18 +169,15 @@ static void wantreadwrite(Connection *self)
 }
 
 #ifdef WITH_TLS
-static void checkPendingTls(void *receiver, void *sender, void *args)
+static void tlsConnectTimeout(void *receiver, Timer *timer)
 {
-    (void)sender;
-    (void)args;
+    (void)timer;
 
     Connection *self = receiver;
-    if (self->tls_connect_ticks && !--self->tls_connect_ticks)
-    {
-	IBLog_fmt(L_INFO, "connection: TLS handshake timeout with %s",
-		Connection_remoteAddr(self));
-	Connection_close(self, 1);
-    }
+    self->connectTimer = 0;
+    IBLog_fmt(L_INFO, "connection: TLS handshake timeout with %s",
+	    Connection_remoteAddr(self));
+    Connection_close(self, 1);
 }
 
 static void dohandshake(Connection *self)
@@ -175,8 +188,8 @@ static void dohandshake(Connection *self)
 	self->tls_connect_st = 0;
 	IBLog_fmt(L_DEBUG, "connection: connected to %s",
 		Connection_remoteAddr(self));
-	Event_unregister(Service_tick(), self, checkPendingTls, 0);
-	self->tls_connect_ticks = 0;
+	Service_cancelTimer(self->connectTimer);
+	self->connectTimer = 0;
 	Event_raise(self->connected, 0, 0);
     }
     else
@@ -190,7 +203,8 @@ static void dohandshake(Connection *self)
 	{
 	    IBLog_fmt(L_ERROR, "connection: TLS handshake failed with %s",
 		    Connection_remoteAddr(self));
-	    Event_unregister(Service_tick(), self, checkPendingTls, 0);
+	    Service_cancelTimer(self->connectTimer);
+	    self->connectTimer = 0;
 	    Connection_close(self, 1);
 	    return;
 	}
@@ -199,32 +213,61 @@ static void dohandshake(Connection *self)
 }
 #endif
 
+static int completeWrite(Connection *self, size_t written, void **ids)
+{
+    int nids = 0;
+    while (self->nrecs)
+    {
+	WriteRecord *rec = self->writerecs + self->baserecidx;
+	size_t left = rec->wrbuflen - rec->wrbufpos;
+	if (written < left)
+	{
+	    rec->wrbufpos += written;
+	    break;
+	}
+	written -= left;
+	if (rec->id) ids[nids++] = rec->id;
+	if (++self->baserecidx == NWRITERECS) self->baserecidx = 0;
+	--self->nrecs;
+    }
+    return nids;
+}
+
 static void dowrite(Connection *self)
 {
-    WriteRecord *rec = self->writerecs + self->baserecidx;
-    void *id = 0;
+    void *ids[NWRITERECS];
+    int nids = 0;
 #ifdef WITH_TLS
     if (self->tls)
     {
+	/* a write that wanted to be retried must be repeated with the same
+	 * data, so only coalesce new records once the last one completed */
+	if (!self->tls_wrbuflen)
+	{
+	    for (uint8_t i = 0; i < self->nrecs; ++i)
+	    {
+		WriteRecord *rec = self->writerecs
+		    + (self->baserecidx + i) % NWRITERECS;
+		size_t len = rec->wrbuflen - rec->wrbufpos;
+		if (self->tls_wrbuflen + len > self->tls_wrbufcapa)
+		{
+		    self->tls_wrbufcapa = self->tls_wrbuflen + len;
+		    self->tls_wrbuf = IB_xrealloc(self->tls_wrbuf,
+			    self->tls_wrbufcapa);
+		}
+		memcpy(self->tls_wrbuf + self->tls_wrbuflen,
+			rec->wrbuf + rec->wrbufpos, len);
+		self->tls_wrbuflen += len;
+	    }
+	}
 	size_t writesz = 0;
-	int rc = SSL_write_ex(self->tls, rec->wrbuf + rec->wrbufpos,
-		rec->wrbuflen - rec->wrbufpos, &writesz);
+	int rc = SSL_write_ex(self->tls, self->tls_wrbuf, self->tls_wrbuflen,
+		&writesz);
 	if (rc > 0)
 	{
 	    self->tls_write_st = 0;
-	    if (writesz < rec->wrbuflen - rec->wrbufpos)
-	    {
-		rec->wrbufpos += writesz;
-		wantreadwrite(self);
-		return;
-	    }
-	    else id = rec->id;
-	    if (++self->baserecidx == NWRITERECS) self->baserecidx = 0;
-	    --self->nrecs;
-	    if (id)
-	    {
-		Event_raise(self->dataSent, 0, id);
-	    }
+	    self->tls_wrbuflen = 0;
+	    nids = completeWrite(self, writesz, ids);
 	}
 	else
 	{
@@ -246,24 +289,20 @@ static void dowrite(Connection *self)
     else
     {
 #endif
+	struct iovec iov[NWRITERECS];
+	for (uint8_t i = 0; i < self->nrecs; ++i)
+	{
+	    WriteRecord *rec = self->writerecs
+		+ (self->baserecidx + i) % NWRITERECS;
+	    iov[i].iov_base = (void *)(rec->wrbuf + rec->wrbufpos);
+	    iov[i].iov_len = rec->wrbuflen - rec->wrbufpos;
+	}
 	errno = 0;
-	int rc = write(self->fd, rec->wrbuf + rec->wrbufpos,
-		rec->wrbuflen - rec->wrbufpos);
+	ssize_t rc = writev(self->fd, iov, self->nrecs);
 	if (rc >= 0)
 	{
-	    if (rc < rec->wrbuflen - rec->wrbufpos)
-	    {
-		rec->wrbufpos += rc;
-		return;
-	    }
-	    else id = rec->id;
-	    if (++self->baserecidx == NWRITERECS) self->baserecidx = 0;
-	    --self->nrecs;
+	    nids = completeWrite(self, rc, ids);
 	    wantreadwrite(self);
-	    if (id)
-	    {
-		Event_raise(self->dataSent, 0, id);
-	    }
 	}
 	else if (errno == EWOULDBLOCK || errno == EAGAIN)
 	{
@@ -276,10 +315,18 @@ static void dowrite(Connection *self)
 	    IBLog_fmt(L_WARNING, "connection: error writing to %s",
 		    Connection_remoteAddr(self));
 	    Connection_close(self, 0);
+	    return;
 	}
 #ifdef WITH_TLS
     }
 #endif
+
+    /* raise only after the ring is consistent again, handlers will likely
+     * queue new records */
+    for (int i = 0; i < nids; ++i)
+    {
+	Event_raise(self->dataSent, 0, ids[i]);
+    }
 }
 
 static void writeConnection(void *receiver, void *sender, void *args)
@@ -290,7 +337,8 @@ static void writeConnection(void *receiver, void *sender, void *args)
     Connection *self = receiver;
     if (self->connecting)
     {
-	Event_unregister(Service_tick(), self, checkPendingConnection, 0);
+	Service_cancelTimer(self->connectTimer);
+	self->connectTimer = 0;
 	int err = 0;
 	socklen_t errlen = sizeof err;
 	if (getsockopt(self->fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0
@@ -305,8 +353,8 @@ static void writeConnection(void *receiver, void *sender, void *args)
 #ifdef WITH_TLS
 	if (self->tls)
 	{
-	    self->tls_connect_ticks = CONNTICKS;
-	    Event_register(Service_tick(), self, checkPendingTls, 0);
+	    self->connectTimer = Service_addTimer(CONNTIMEOUT, 0,
+		    self, tlsConnectTimeout);
 	    dohandshake(self);
 	    return;
 	}
@@ -340,22 +388,79 @@ static void writeConnection(void *receiver, void *sender, void *args)
 #endif
 }
 
+static uint8_t *readBuffer(Connection *self, size_t *avail)
+{
+    size_t used = self->rdbufpos + self->rdbuflen;
+    if (self->rdbufsz - used < CONNBUFSZ && self->rdbufpos)
+    {
+	/* only the unconsumed rest (normally a partial line) is moved, and
+	 * only once the end of the buffer is reached */
+	memmove(self->rdbuf, self->rdbuf + self->rdbufpos, self->rdbuflen);
+	self->rdbufpos = 0;
+	used = self->rdbuflen;
+    }
+    if (self->rdbufsz - used < CONNBUFSZ && self->rdbufsz < self->rdbufmax)
+    {
+	size_t sz = self->rdbufsz ? 2 * self->rdbufsz : 2 * CONNBUFSZ;
+	if (sz > self->rdbufmax) sz = self->rdbufmax;
+	self->rdbuf = IB_xrealloc(self->rdbuf, sz);
+	self->rdbufsz = sz;
+    }
+    *avail = self->rdbufsz - used;
+    return self->rdbuf + used;
+}
+
+static void dataRead(Connection *self, size_t size)
+{
+    self->rdbuflen += size;
+    self->args.buf = self->rdbuf + self->rdbufpos;
+    self->args.size = self->rdbuflen;
+    self->args.consumed = self->rdbuflen;
+    Event_raise(self->dataReceived, 0, &self->args);
+    size_t consumed = self->args.consumed;
+    if (consumed > self->rdbuflen) consumed = self->rdbuflen;
+    self->rdbufpos += consumed;
+    self->rdbuflen -= consumed;
+    if (!self->rdbuflen) self->rdbufpos = 0;
+    if (self->args.handling)
+    {
+	IBLog_fmt(L_DEBUG, "connection: blocking reads from %s",
+		Connection_remoteAddr(self));
+    }
+}
+
 static void doread(Connection *self)
 {
+    size_t avail;
+    uint8_t *buf = readBuffer(self, &avail);
+    if (!avail)
+    {
+	IBLog_fmt(L_ERROR, "connection: read buffer for %s exhausted",
+		Connection_remoteAddr(self));
+	Connection_close(self, 0);
+	return;
+    }
 #ifdef WITH_TLS
     if (self->tls)
     {
 	size_t readsz = 0;
-	int rc = SSL_read_ex(self->tls, self->rdbuf, CONNBUFSZ, &readsz);
+	int rc = SSL_read_ex(self->tls, buf, avail, &readsz);
 	if (rc > 0)
 	{
 	    self->tls_read_st = 0;
-	    self->args.size = readsz;
-	    Event_raise(self->dataReceived, 0, &self->args);
-	    if (self->args.handling)
+	    dataRead(self, readsz);
+
+	    /* data already decrypted by OpenSSL won't make the socket
+	     * readable again, so fetch it right away */
+	    while (!self->deleteScheduled && !self->args.handling
+		    && SSL_pending(self->tls))
 	    {
-		IBLog_fmt(L_DEBUG, "connection: blocking reads from %s",
-			Connection_remoteAddr(self));
+		buf = readBuffer(self, &avail);
+		if (!avail || SSL_read_ex(self->tls, buf, avail, &readsz) <= 0)
+		{
+		    break;
+		}
+		dataRead(self, readsz);
 	    }
 	}
 	else
@@ -379,16 +484,10 @@ static void doread(Connection *self)
     {
 #endif
 	errno = 0;
-	int rc = read(self->fd, self->rdbuf, CONNBUFSZ);
+	ssize_t rc = read(self->fd, buf, avail);
 	if (rc > 0)
 	{
-	    self->args.size = rc;
-	    Event_raise(self->dataReceived, 0, &self->args);
-	    if (self->args.handling)
-	    {
-		IBLog_fmt(L_DEBUG, "connection: blocking reads from %s",
-			Connection_remoteAddr(self));
-	    }
+	    dataRead(self, rc);
 	    wantreadwrite(self);
 	}
 	else if (errno == EWOULDBLOCK || errno == EAGAIN)
@@ -457,6 +556,9 @@ SOLOCAL Connection *Connection_create(int fd, const ConnOpts *opts)
     self->dataReceived = Event_create(self);
     self->dataSent = Event_create(self);
     self->resolveJob = 0;
+    self->connectTimer = 0;
+    self->deleteHandle = 0;
+    self->resolveHandle = 0;
     self->fd = fd;
     self->connecting = 0;
     self->addr = 0;
@@ -512,21 +614,32 @@ SOLOCAL Connection *Connection_create(int fd, const ConnOpts *opts)
     {
 	self->tls = 0;
     }
+    self->tls_wrbuf = 0;
+    self->tls_wrbuflen = 0;
+    self->tls_wrbufcapa = 0;
     self->tls_connect_st = 0;
     self->tls_read_st = 0;
     self->tls_write_st = 0;
 #endif
-    self->args.buf = self->rdbuf;
+    self->rdbuf = 0;
+    self->rdbufsz = 0;
+    self->rdbufpos = 0;
+    self->rdbuflen = 0;
+    self->rdbufmax = CONNBUFMAX;
+    self->args.buf = 0;
     self->args.handling = 0;
     self->deleteScheduled = 0;
     self->nrecs = 0;
     self->baserecidx = 0;
-    Event_register(Service_readyRead(), self, readConnection, fd);
-    Event_register(Service_readyWrite(), self, writeConnection, fd);
+    self->readHandle = Event_register(Service_readyRead(),
+	    self, readConnection, fd);
+    self->writeHandle = Event_register(Service_readyWrite(),
+	    self, writeConnection, fd);
     if (opts->createmode == CCM_CONNECTING)
     {
-	self->connecting = CONNTICKS;
-	Event_register(Service_tick(), self, checkPendingConnection, 0);
+	self->connecting = 1;
+	self->connectTimer = Service_addTimer(CONNTIMEOUT, 0,
+		self, connectTimeout);
 	Service_registerWrite(fd);
     }
     else if (opts->createmode == CCM_NORMAL)
@@ -620,10 +733,17 @@ SOLOCAL void Connection_setRemoteAddr(Connection *self,
 	    if (!numericOnly && ThreadPool_active())
 	    {
 		self->resolveJob = ThreadJob_create(resolveRemoteAddrProc,
-			&self->resolveArgs, RESOLVTICKS);
-		Event_register(ThreadJob_finished(self->resolveJob), self,
+			&self->resolveArgs, RESOLVTIMEOUT);
+		self->resolveHandle = Event_register(
+			ThreadJob_finished(self->resolveJob), self,
 			resolveRemoteAddrFinished, 0);
-		ThreadPool_enqueue(self->resolveJob);
+		if (ThreadPool_enqueue(self->resolveJob) != 0)
+		{
+		    IBLog_fmt(L_DEBUG, "connection: not resolving name for "
+			    "%s, thread pool overloaded", self->addr);
+		    ThreadJob_destroy(self->resolveJob);
+		    self->resolveJob = 0;
+		}
 	    }
 	}
     }
@@ -651,6 +771,18 @@ SOLOCAL int Connection_write(Connection *self,
     return 0;
 }
 
+SOLOCAL unsigned Connection_writeRecsFree(const Connection *self)
+{
+    return NWRITERECS - self->nrecs;
+}
+
+SOLOCAL void Connection_setMaxReadBuffer(Connection *self, size_t size)
+{
+    if (size < 2 * CONNBUFSZ) size = 2 * CONNBUFSZ;
+    if (size < self->rdbufsz) size = self->rdbufsz;
+    self->rdbufmax = size;
+}
+
 SOLOCAL void Connection_activate(Connection *self)
 {
     if (self->args.handling) return;
@@ -703,7 +835,8 @@ static void deleteLater(Connection *self)
     if (!self->deleteScheduled)
     {
 	close(self->fd);
-	Event_register(Service_eventsDone(), self, deleteConnection, 0);
+	self->deleteHandle = Event_register(Service_eventsDone(),
+		self, deleteConnection, 0);
 	self->deleteScheduled = 1;
     }
 }
@@ -726,7 +859,7 @@ SOLOCAL void Connection_destroy(Connection *self)
     }
     if (self->deleteScheduled)
     {
-	Event_unregister(Service_eventsDone(), self, deleteConnection, 0);
+	Event_unregisterHandle(Service_eventsDone(), self->deleteHandle);
     }
     else
     {
@@ -734,23 +867,24 @@ SOLOCAL void Connection_destroy(Connection *self)
     }
 #ifdef WITH_TLS
     SSL_free(self->tls);
+    free(self->tls_wrbuf);
     if (tls_nconn && !--tls_nconn)
     {
 	SSL_CTX_free(tls_ctx);
 	tls_ctx = 0;
     }
-    Event_unregister(Service_tick(), self, checkPendingTls, 0);
 #endif
-    Event_unregister(Service_tick(), self, checkPendingConnection, 0);
-    Event_unregister(Service_readyRead(), self, readConnection, self->fd);
-    Event_unregister(Service_readyWrite(), self, writeConnection, self->fd);
+    Service_cancelTimer(self->connectTimer);
+    Event_unregisterHandle(Service_readyRead(), self->readHandle);
+    Event_unregisterHandle(Service_readyWrite(), self->writeHandle);
     if (self->resolveJob)
     {
 	ThreadPool_cancel(self->resolveJob);
-	Event_unregister(ThreadJob_finished(self->resolveJob), self,
-		resolveRemoteAddrFinished, 0);
+	Event_unregisterHandle(ThreadJob_finished(self->resolveJob),
+		self->resolveHandle);
     }
     if (self->deleter) self->deleter(self->data);
+    free(self->rdbuf);
     free(self->addr);
     free(self->name);
     Event_destroy(self->dataSent);
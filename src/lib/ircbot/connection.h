@@ -5,6 +5,7 @@
 
 #include "connopts.h"
 
+#include <stddef.h>
 #include <stdint.h>
 #include <sys/socket.h>
 
@@ -14,8 +15,9 @@ C_CLASS_DECL(Event);
 typedef struct DataReceivedEventArgs
 {
     uint8_t *buf;
+    size_t size;
+    size_t consumed;
     int handling;
-    uint16_t size;
 } DataReceivedEventArgs;
 
 Connection *Connection_create(int fd, const ConnOpts *opts)
@@ -38,6 +40,8 @@ void Connection_setRemoteAddr(Connection *self,
 void Connection_setRemoteAddrStr(Connection *self, const char *addr) CMETHOD;
 int Connection_write(Connection *self,
 	const uint8_t *buf, uint16_t sz, void *id) CMETHOD ATTR_NONNULL((2));
+unsigned Connection_writeRecsFree(const Connection *self) CMETHOD ATTR_PURE;
+void Connection_setMaxReadBuffer(Connection *self, size_t size) CMETHOD;
 void Connection_activate(Connection *self) CMETHOD;
 int Connection_confirmDataReceived(Connection *self) CMETHOD;
 void Connection_close(Connection *self, int blacklist) CMETHOD;
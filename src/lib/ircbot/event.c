@@ -7,100 +7,233 @@
 #include <string.h>
 
 #define EVCHUNKSIZE 4
+#define EVKEYCHUNKSIZE 64
+#define EVSLOTCHUNKSIZE 16
 
 typedef struct EvHandler
 {
     void *receiver;
     EventHandler handler;
     int id;
+    uint32_t slot;
 } EvHandler;
 
-struct Event
+typedef struct EvHandlerList
 {
-    void *sender;
     EvHandler *handlers;
     size_t size;
     size_t capa;
-    int dirty;
+    size_t ndead;
+} EvHandlerList;
+
+/* A slot tracks where a registration currently lives in its handler list.
+ * The generation is bumped when the slot is freed, so stale handles never
+ * match a reused slot. Free slots are chained through "pos". */
+typedef struct EvSlot
+{
+    size_t list;
+    size_t pos;
+    uint32_t gen;
+} EvSlot;
+
+struct Event
+{
+    void *sender;
+    EvHandlerList *lists;
+    EvSlot *slots;
+    size_t nlists;
+    size_t nslots;
+    size_t slotscapa;
+    size_t freeslot;
+    unsigned raising;
+    int keyed;
 };
 
+static EvHandlerList *handlerList(Event *self, int id, int create);
+static uint32_t allocSlot(Event *self, size_t list, size_t pos) CMETHOD;
+static void removeAt(Event *self, EvHandlerList *list, size_t pos) CMETHOD;
+static void compact(Event *self, EvHandlerList *list) CMETHOD;
+
+static EvHandlerList *handlerList(Event *self, int id, int create)
+{
+    size_t idx = 0;
+    if (self->keyed)
+    {
+	if (id < 0) return 0;
+	idx = id;
+    }
+    if (idx >= self->nlists)
+    {
+	if (!create) return 0;
+	size_t nlists = self->nlists;
+	while (nlists <= idx) nlists += self->keyed ? EVKEYCHUNKSIZE : 1;
+	self->lists = IB_xrealloc(self->lists, nlists * sizeof *self->lists);
+	memset(self->lists + self->nlists, 0,
+		(nlists - self->nlists) * sizeof *self->lists);
+	self->nlists = nlists;
+    }
+    return self->lists + idx;
+}
+
+static uint32_t allocSlot(Event *self, size_t list, size_t pos)
+{
+    size_t slot = self->freeslot;
+    if (slot < self->nslots)
+    {
+	self->freeslot = self->slots[slot].pos;
+    }
+    else
+    {
+	if (self->nslots == self->slotscapa)
+	{
+	    self->slotscapa += EVSLOTCHUNKSIZE;
+	    self->slots = IB_xrealloc(self->slots,
+		    self->slotscapa * sizeof *self->slots);
+	}
+	slot = self->nslots++;
+	self->slots[slot].gen = 1;
+	self->freeslot = self->nslots;
+    }
+    self->slots[slot].list = list;
+    self->slots[slot].pos = pos;
+    return slot;
+}
+
+static void removeAt(Event *self, EvHandlerList *list, size_t pos)
+{
+    EvHandler *h = list->handlers + pos;
+    EvSlot *slot = self->slots + h->slot;
+    h->handler = 0;
+    ++list->ndead;
+    ++slot->gen;
+    slot->pos = self->freeslot;
+    self->freeslot = h->slot;
+}
+
+static void compact(Event *self, EvHandlerList *list)
+{
+    size_t size = 0;
+    for (size_t pos = 0; pos < list->size; ++pos)
+    {
+	if (!list->handlers[pos].handler) continue;
+	if (size < pos)
+	{
+	    list->handlers[size] = list->handlers[pos];
+	    self->slots[list->handlers[size].slot].pos = size;
+	}
+	++size;
+    }
+    list->size = size;
+    list->ndead = 0;
+}
+
 SOLOCAL Event *Event_create(void *sender)
 {
     Event *self = IB_xmalloc(sizeof *self);
     self->sender = sender;
-    self->handlers = 0;
-    self->size = 0;
-    self->capa = 0;
-    self->dirty = 0;
+    self->lists = 0;
+    self->slots = 0;
+    self->nlists = 0;
+    self->nslots = 0;
+    self->slotscapa = 0;
+    self->freeslot = 0;
+    self->raising = 0;
+    self->keyed = 0;
     return self;
 }
 
-SOLOCAL void Event_register(Event *self, void *receiver,
+SOLOCAL Event *Event_createKeyed(void *sender)
+{
+    Event *self = Event_create(sender);
+    self->keyed = 1;
+    return self;
+}
+
+SOLOCAL EventHandle Event_register(Event *self, void *receiver,
 	EventHandler handler, int id)
 {
-    if (self->dirty)
+    EvHandlerList *list = handlerList(self, id, 1);
+    if (!list)
     {
-	for (size_t pos = 0; pos < self->size; ++pos)
-	{
-	    if (!self->handlers[pos].handler)
-	    {
-		--self->size;
-		if (pos < self->size)
-		{
-		    memmove(self->handlers + pos, self->handlers + pos + 1,
-			    (self->size - pos) * sizeof *self->handlers);
-		}
-		--pos;
-	    }
-	}
-	self->dirty = 0;
+	IBLog_fmt(L_ERROR, "event: invalid id %d for keyed event", id);
+	return 0;
     }
-    if (self->size == self->capa)
+    /* never move handlers while Event_raise() is iterating over them */
+    if (!self->raising && list->ndead && list->ndead * 2 >= list->size)
     {
-        self->capa += EVCHUNKSIZE;
-        self->handlers = IB_xrealloc(self->handlers,
-                self->capa * sizeof *self->handlers);
+	compact(self, list);
     }
-    self->handlers[self->size].receiver = receiver;
-    self->handlers[self->size].handler = handler;
-    self->handlers[self->size].id = id;
-    ++self->size;
+    if (list->size == list->capa)
+    {
+        list->capa += EVCHUNKSIZE;
+        list->handlers = IB_xrealloc(list->handlers,
+                list->capa * sizeof *list->handlers);
+    }
+    uint32_t slot = allocSlot(self, list - self->lists, list->size);
+    list->handlers[list->size].receiver = receiver;
+    list->handlers[list->size].handler = handler;
+    list->handlers[list->size].id = id;
+    list->handlers[list->size].slot = slot;
+    ++list->size;
+    return ((EventHandle)self->slots[slot].gen << 32) | (slot + 1);
 }
 
 SOLOCAL void Event_unregister(
 	Event *self, void *receiver, EventHandler handler, int id)
 {
+    EvHandlerList *list = handlerList(self, id, 0);
+    if (!list) return;
     size_t pos;
-    for (pos = 0; pos < self->size; ++pos)
+    for (pos = 0; pos < list->size; ++pos)
     {
-        if (self->handlers[pos].receiver == receiver
-                && self->handlers[pos].handler == handler
-		&& self->handlers[pos].id == id)
+        if (list->handlers[pos].receiver == receiver
+                && list->handlers[pos].handler == handler
+		&& list->handlers[pos].id == id)
         {
-	    self->handlers[pos].handler = 0;
-	    self->dirty = 1;
+	    removeAt(self, list, pos);
             break;
         }
     }
 }
 
+SOLOCAL void Event_unregisterHandle(Event *self, EventHandle handle)
+{
+    size_t slot = (uint32_t)handle;
+    if (!slot-- || slot >= self->nslots) return;
+    EvSlot *s = self->slots + slot;
+    if (s->gen != (uint32_t)(handle >> 32)) return;
+    removeAt(self, self->lists + s->list, s->pos);
+}
+
 SOLOCAL void Event_raise(Event *self, int id, void *args)
 {
-    for (size_t i = 0; i < self->size; ++i)
+    size_t idx = 0;
+    if (self->keyed)
+    {
+	if (id < 0) return;
+	idx = id;
+    }
+
+    /* handlers might register for other ids, so the list array could
+     * move while iterating */
+    ++self->raising;
+    for (size_t i = 0; idx < self->nlists && i < self->lists[idx].size; ++i)
     {
-	if (self->handlers[i].id == id && self->handlers[i].handler)
+	EvHandler *h = self->lists[idx].handlers + i;
+	if (h->id == id && h->handler)
 	{
 	    if (!args && id) args = &id;
-	    self->handlers[i].handler(self->handlers[i].receiver,
-		    self->sender, args);
+	    h->handler(h->receiver, self->sender, args);
 	}
     }
+    --self->raising;
 }
 
 SOLOCAL void Event_destroy(Event *self)
 {
     if (!self) return;
-    free(self->handlers);
+    for (size_t i = 0; i < self->nlists; ++i) free(self->lists[i].handlers);
+    free(self->lists);
+    free(self->slots);
     free(self);
 }
-
@@ -3,15 +3,22 @@
 
 #include <ircbot/decl.h>
 
+#include <stdint.h>
+
 typedef void (*EventHandler)(void *receiver, void *sender, void *args);
 
+/* identifies a single registration, 0 is never a valid handle */
+typedef uint64_t EventHandle;
+
 C_CLASS_DECL(Event);
 
 Event *Event_create(void *sender) ATTR_RETNONNULL;
-void Event_register(Event *self, void *receiver,
+Event *Event_createKeyed(void *sender) ATTR_RETNONNULL;
+EventHandle Event_register(Event *self, void *receiver,
 	EventHandler handler, int id) CMETHOD ATTR_NONNULL((3));
 void Event_unregister(Event *self, void *receiver,
 	EventHandler handler, int id) CMETHOD ATTR_NONNULL((3));
+void Event_unregisterHandle(Event *self, EventHandle handle) CMETHOD;
 void Event_raise(Event *self, int id, void *args) CMETHOD;
 void Event_destroy(Event *self);
 
@@ -1,25 +1,37 @@
-#include <ircbot/hashtable.h>
-
+#include "hashtable.h"
 #include "util.h"
 
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
-typedef struct IBHashTableEntry IBHashTableEntry;
-struct IBHashTableEntry
+#define HTMINBITS 2
+#define HTMAXBITS 8
+#define HTMAXLOAD(capa) ((capa) - (capa) / 4)
+#define HTMINLOAD(capa) ((capa) / 8)
+
+/* Robin Hood open addressing: an entry never sits further away from its
+ * home slot than the entry it would displace, so lookups can stop as soon
+ * as they meet an entry closer to home than the probe so far. The full
+ * hash is stored to skip most key comparisons and for resizing. */
+
+typedef struct IBHashTableEntry
 {
-    IBHashTableEntry *next;
     char *key;
     void *obj;
     void (*deleter)(void *);
-};
+    uint32_t hash;
+    uint32_t dist;	/* distance from home slot + 1, 0 for an empty slot */
+} IBHashTableEntry;
 
 struct IBHashTable
 {
+    IBHashTableEntry *entries;
     size_t count;
-    uint8_t bits;
-    IBHashTableEntry *bucket[];
+    size_t mask;
+    size_t mincapa;
+    IBCaseMapping mapping;
+    int refKeys;
 };
 
 typedef struct IteratorEntry
@@ -35,68 +47,176 @@ struct IBHashTableIterator
     IteratorEntry entries[];
 };
 
+static IBHashTableEntry *find(const IBHashTable *self,
+	const char *key, uint32_t hash);
+static void insert(IBHashTable *self, IBHashTableEntry entry);
+static void resize(IBHashTable *self, size_t capa);
+static void freeKey(const IBHashTable *self, char *key);
+
+static IBHashTableEntry *find(const IBHashTable *self,
+	const char *key, uint32_t hash)
+{
+    size_t pos = hash & self->mask;
+    for (uint32_t dist = 1;; ++dist)
+    {
+	IBHashTableEntry *entry = self->entries + pos;
+	if (entry->dist < dist) return 0;
+	if (entry->hash == hash && !strcmpmap(entry->key, key, self->mapping))
+	{
+	    return entry;
+	}
+	pos = (pos + 1) & self->mask;
+    }
+}
+
+static void insert(IBHashTable *self, IBHashTableEntry entry)
+{
+    size_t pos = entry.hash & self->mask;
+    for (entry.dist = 1;; ++entry.dist)
+    {
+	IBHashTableEntry *slot = self->entries + pos;
+	if (!slot->dist)
+	{
+	    *slot = entry;
+	    return;
+	}
+	if (slot->dist < entry.dist)
+	{
+	    IBHashTableEntry displaced = *slot;
+	    *slot = entry;
+	    entry = displaced;
+	}
+	pos = (pos + 1) & self->mask;
+    }
+}
+
+static void resize(IBHashTable *self, size_t capa)
+{
+    IBHashTableEntry *old = self->entries;
+    size_t oldcapa = self->mask + 1;
+    self->entries = IB_xmalloc(capa * sizeof *self->entries);
+    memset(self->entries, 0, capa * sizeof *self->entries);
+    self->mask = capa - 1;
+    for (size_t i = 0; i < oldcapa; ++i)
+    {
+	if (old[i].dist) insert(self, old[i]);
+    }
+    free(old);
+}
+
+static void freeKey(const IBHashTable *self, char *key)
+{
+    if (!self->refKeys) free(key);
+}
+
 SOEXPORT IBHashTable *IBHashTable_create(uint8_t bits)
 {
-    size_t htsize = HT_SIZE(bits);
-    IBHashTable *self = IB_xmalloc(sizeof *self + htsize * sizeof *self->bucket);
-    memset(self, 0, sizeof *self + htsize * sizeof *self->bucket);
-    self->bits = bits;
+    if (bits < HTMINBITS) bits = HTMINBITS;
+    if (bits > HTMAXBITS) bits = HTMAXBITS;
+    IBHashTable *self = IB_xmalloc(sizeof *self);
+    self->mincapa = (size_t)1 << bits;
+    self->entries = IB_xmalloc(self->mincapa * sizeof *self->entries);
+    memset(self->entries, 0, self->mincapa * sizeof *self->entries);
+    self->count = 0;
+    self->mask = self->mincapa - 1;
+    self->mapping = IBCM_NONE;
+    self->refKeys = 0;
     return self;
 }
 
-SOEXPORT void IBHashTable_set(IBHashTable *self, const char *key,
-	void *obj, void (*deleter)(void *))
+SOLOCAL IBHashTable *IBHashTable_createRefKeys(uint8_t bits, size_t count)
+{
+    IBHashTable *self = IBHashTable_create(bits);
+    self->refKeys = 1;
+    size_t capa = self->mincapa;
+    while (HTMAXLOAD(capa) < count) capa <<= 1;
+    if (capa != self->mincapa)
+    {
+	free(self->entries);
+	self->entries = IB_xmalloc(capa * sizeof *self->entries);
+	memset(self->entries, 0, capa * sizeof *self->entries);
+	self->mask = capa - 1;
+    }
+    return self;
+}
+
+SOEXPORT void IBHashTable_setCaseMapping(IBHashTable *self,
+	IBCaseMapping mapping)
 {
-    uint8_t h = hashstr(key, self->bits);
-    IBHashTableEntry *parent = 0;
-    IBHashTableEntry *entry = self->bucket[h];
-    while (entry)
+    if (mapping == self->mapping) return;
+    self->mapping = mapping;
+    IBHashTableEntry *old = self->entries;
+    size_t capa = self->mask + 1;
+    self->entries = IB_xmalloc(capa * sizeof *self->entries);
+    memset(self->entries, 0, capa * sizeof *self->entries);
+    for (size_t i = 0; i < capa; ++i)
     {
-	if (!strcmp(entry->key, key)) break;
-	parent = entry;
-	entry = parent->next;
+	if (!old[i].dist) continue;
+	old[i].hash = hashstr(old[i].key, mapping);
+	if (find(self, old[i].key, old[i].hash))
+	{
+	    if (old[i].deleter) old[i].deleter(old[i].obj);
+	    freeKey(self, old[i].key);
+	    --self->count;
+	}
+	else insert(self, old[i]);
     }
+    free(old);
+}
+
+SOEXPORT void IBHashTable_set(IBHashTable *self, const char *key,
+	void *obj, void (*deleter)(void *))
+{
+    uint32_t h = hashstr(key, self->mapping);
+    IBHashTableEntry *entry = find(self, key, h);
     if (entry)
     {
 	if (entry->deleter) entry->deleter(entry->obj);
+	if (self->refKeys) entry->key = (char *)key;
 	entry->obj = obj;
 	entry->deleter = deleter;
+	return;
     }
-    else
+    if (self->count + 1 > HTMAXLOAD(self->mask + 1))
     {
-	entry = IB_xmalloc(sizeof *entry);
-	entry->next = 0;
-	entry->key = IB_copystr(key);
-	entry->obj = obj;
-	entry->deleter = deleter;
-	if (parent) parent->next = entry;
-	else self->bucket[h] = entry;
-	++self->count;
+	resize(self, (self->mask + 1) << 1);
     }
+    insert(self, (IBHashTableEntry){
+	    .key = self->refKeys ? (char *)key : IB_copystr(key),
+	    .obj = obj,
+	    .deleter = deleter,
+	    .hash = h
+	});
+    ++self->count;
 }
 
 SOEXPORT int IBHashTable_delete(IBHashTable *self, const char *key)
 {
-    uint8_t h = hashstr(key, self->bits);
-    IBHashTableEntry *parent = 0;
-    IBHashTableEntry *entry = self->bucket[h];
-    while (entry)
+    IBHashTableEntry *entry = find(self, key, hashstr(key, self->mapping));
+    if (!entry) return 0;
+    IBHashTableEntry deleted = *entry;
+
+    /* shift the following entries of the cluster back by one slot */
+    size_t pos = entry - self->entries;
+    size_t next = (pos + 1) & self->mask;
+    while (self->entries[next].dist > 1)
     {
-	if (!strcmp(entry->key, key)) break;
-	parent = entry;
-	entry = entry->next;
+	self->entries[pos] = self->entries[next];
+	--self->entries[pos].dist;
+	pos = next;
+	next = (next + 1) & self->mask;
     }
-    if (entry)
+    memset(self->entries + pos, 0, sizeof *self->entries);
+    --self->count;
+
+    if (self->mask + 1 > self->mincapa
+	    && self->count < HTMINLOAD(self->mask + 1))
     {
-	if (entry->deleter) entry->deleter(entry->obj);
-	if (parent) parent->next = entry->next;
-	else self->bucket[h] = entry->next;
-	free(entry->key);
-	free(entry);
-	--self->count;
-	return 1;
+	resize(self, (self->mask + 1) >> 1);
     }
-    return 0;
+    if (deleted.deleter) deleted.deleter(deleted.obj);
+    freeKey(self, deleted.key);
+    return 1;
 }
 
 SOEXPORT size_t IBHashTable_count(const IBHashTable *self)
@@ -106,13 +226,8 @@ SOEXPORT size_t IBHashTable_count(const IBHashTable *self)
 
 SOEXPORT void *IBHashTable_get(const IBHashTable *self, const char *key)
 {
-    IBHashTableEntry *entry = self->bucket[hashstr(key, self->bits)];
-    while (entry)
-    {
-	if (!strcmp(entry->key, key)) return entry->obj;
-	entry = entry->next;
-    }
-    return 0;
+    IBHashTableEntry *entry = find(self, key, hashstr(key, self->mapping));
+    return entry ? entry->obj : 0;
 }
 
 SOEXPORT IBHashTableIterator *IBHashTable_iterator(const IBHashTable *self)
@@ -122,16 +237,13 @@ SOEXPORT IBHashTableIterator *IBHashTable_iterator(const IBHashTable *self)
     iter->count = self->count;
     iter->pos = self->count;
     size_t pos = 0;
-    for (unsigned h = 0; h < HT_SIZE(self->bits); ++h)
+    for (size_t i = 0; i <= self->mask; ++i)
     {
-	IBHashTableEntry *entry = self->bucket[h];
-	while (entry)
-	{
-	    iter->entries[pos].key = entry->key;
-	    iter->entries[pos].obj = entry->obj;
-	    ++pos;
-	    entry = entry->next;
-	}
+	IBHashTableEntry *entry = self->entries + i;
+	if (!entry->dist) continue;
+	iter->entries[pos].key = entry->key;
+	iter->entries[pos].obj = entry->obj;
+	++pos;
     }
     return iter;
 }
@@ -139,19 +251,14 @@ SOEXPORT IBHashTableIterator *IBHashTable_iterator(const IBHashTable *self)
 SOEXPORT void IBHashTable_destroy(IBHashTable *self)
 {
     if (!self) return;
-    for (unsigned h = 0; h < HT_SIZE(self->bits); ++h)
+    for (size_t i = 0; i <= self->mask; ++i)
     {
-	IBHashTableEntry *entry = self->bucket[h];
-	IBHashTableEntry *next;
-	while (entry)
-	{
-	    next = entry->next;
-	    if (entry->deleter) entry->deleter(entry->obj);
-	    free(entry->key);
-	    free(entry);
-	    entry = next;
-	}
+	IBHashTableEntry *entry = self->entries + i;
+	if (!entry->dist) continue;
+	if (entry->deleter) entry->deleter(entry->obj);
+	freeKey(self, entry->key);
     }
+    free(self->entries);
     free(self);
 }
 
@@ -0,0 +1,14 @@
+#ifndef IRCBOT_INT_HASHTABLE_H
+#define IRCBOT_INT_HASHTABLE_H
+
+#include <ircbot/hashtable.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* create a table that doesn't copy its keys, they must stay valid as long
+ * as they are in the table; count is the number of entries expected */
+IBHashTable *IBHashTable_createRefKeys(uint8_t bits, size_t count)
+    ATTR_RETNONNULL;
+
+#endif
@@ -0,0 +1,100 @@
+#include "ircbatch.h"
+#include "ircmessage.h"
+#include "util.h"
+
+#include <stdlib.h>
+
+#define MSGCHUNK 16
+
+/* the messages are parsed views into lines owned by the batch, it is
+ * immutable once complete, so it can be shared with handler threads */
+struct IrcBatch
+{
+    char *type;
+    char *params[IRCMSG_MAXPARAMS];
+    IrcMessage *msgs;
+    char **lines;
+    size_t nparams;
+    size_t nmsgs;
+    size_t capa;
+    int refcnt;
+};
+
+SOLOCAL IrcBatch *IrcBatch_create(const IrcMessage *start)
+{
+    IrcBatch *self = IB_xmalloc(sizeof *self);
+    const char *type = IrcMessage_param(start, 1);
+    self->type = IB_copystr(type ? type : "");
+    self->nparams = 0;
+    for (size_t i = 2; i < IrcMessage_paramCount(start); ++i)
+    {
+	self->params[self->nparams++] = IB_copystr(IrcMessage_param(start, i));
+    }
+    self->msgs = 0;
+    self->lines = 0;
+    self->nmsgs = 0;
+    self->capa = 0;
+    self->refcnt = 1;
+    return self;
+}
+
+SOLOCAL void IrcBatch_add(IrcBatch *self, char *line, size_t len)
+{
+    if (self->nmsgs == self->capa)
+    {
+	self->capa += MSGCHUNK;
+	self->msgs = IB_xrealloc(self->msgs, self->capa * sizeof *self->msgs);
+	self->lines = IB_xrealloc(self->lines,
+		self->capa * sizeof *self->lines);
+    }
+    self->lines[self->nmsgs] = line;
+    IrcMessage_parse(self->msgs + self->nmsgs++, line, len);
+}
+
+SOLOCAL IrcBatch *IrcBatch_ref(IrcBatch *self)
+{
+    ++self->refcnt;
+    return self;
+}
+
+SOEXPORT const char *IrcBatch_type(const IrcBatch *self)
+{
+    return self->type;
+}
+
+SOEXPORT size_t IrcBatch_paramCount(const IrcBatch *self)
+{
+    return self->nparams;
+}
+
+SOEXPORT const char *IrcBatch_param(const IrcBatch *self, size_t i)
+{
+    if (i >= self->nparams) return 0;
+    return self->params[i];
+}
+
+SOEXPORT size_t IrcBatch_messageCount(const IrcBatch *self)
+{
+    return self->nmsgs;
+}
+
+SOEXPORT const IrcMessage *IrcBatch_message(const IrcBatch *self, size_t i)
+{
+    if (i >= self->nmsgs) return 0;
+    return self->msgs + i;
+}
+
+SOLOCAL void IrcBatch_unref(IrcBatch *self)
+{
+    if (!self || --self->refcnt) return;
+    for (size_t i = 0; i < self->nmsgs; ++i)
+    {
+	IrcMessage_done(self->msgs + i);
+	free(self->lines[i]);
+    }
+    free(self->lines);
+    free(self->msgs);
+    for (size_t i = 0; i < self->nparams; ++i) free(self->params[i]);
+    free(self->type);
+    free(self);
+}
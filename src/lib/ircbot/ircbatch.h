@@ -0,0 +1,15 @@
+#ifndef IRCBOT_INT_IRCBATCH_H
+#define IRCBOT_INT_IRCBATCH_H
+
+#include <ircbot/ircbatch.h>
+
+#include <stddef.h>
+
+IrcBatch *IrcBatch_create(const IrcMessage *start)
+    ATTR_NONNULL((1)) ATTR_RETNONNULL;
+void IrcBatch_add(IrcBatch *self, char *line, size_t len)
+    CMETHOD ATTR_NONNULL((2));
+IrcBatch *IrcBatch_ref(IrcBatch *self) CMETHOD ATTR_RETNONNULL;
+void IrcBatch_unref(IrcBatch *self);
+
+#endif
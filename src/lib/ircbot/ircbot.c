@@ -2,9 +2,11 @@
 #include <ircbot/irccommand.h>
 #include <ircbot/list.h>
 #include <ircbot/log.h>
+#include <ircbot/stringbuilder.h>
 
 #include "daemon.h"
 #include "event.h"
+#include "ircbatch.h"
 #include "ircbot.h"
 #include "ircchannel.h"
 #include "ircmessage.h"
@@ -13,9 +15,13 @@
 #include "threadpool.h"
 #include "util.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#define NEVENTTYPES (IBET_BATCH + 1)
+#define HANDLERSCHUNK 8
+
 struct IrcBotResponse
 {
     IBList *messages;
@@ -28,6 +34,8 @@ struct IrcBotEvent
     char *command;
     char *from;
     char *arg;
+    IrcBatch *batch;
+    ThreadJobGroup *children;
     IrcBotResponse response;
     IrcBotEventType type;
 };
@@ -39,8 +47,26 @@ typedef struct IrcBotEventHandler
     const char *origin;
     const char *filter;
     IrcBotEventType type;
+    unsigned seq;
 } IrcBotEventHandler;
 
+/* handlers of one event type, in the order they were added */
+typedef struct HandlerList
+{
+    IrcBotEventHandler **hdl;
+    size_t n;
+    size_t capa;
+} HandlerList;
+
+/* handlers of one event type are indexed by their filter, a lookup only
+ * looks at handlers with a matching filter and those without one, the
+ * first one added wins as before */
+typedef struct HandlerIndex
+{
+    IBHashTable *byFilter;
+    HandlerList any;
+} HandlerIndex;
+
 typedef struct IrcBotResponseMessage
 {
     char *to;
@@ -62,7 +88,10 @@ static IBThreadOpts threadOpts = {
     .queueLen = 0,
     .maxQueueLen = 1024,
     .minQueueLen = 64,
-    .qLenPerThread = 2
+    .qLenPerThread = 2,
+    .workStealing = 0,
+    .overloadPolicy = IBOP_REJECT,
+    .rejectHandler = 0
 };
 
 static DaemonOpts daemonOpts = {
@@ -76,17 +105,24 @@ static DaemonOpts daemonOpts = {
 static int (*startupfunc)(void) = 0;
 static void (*shutdownfunc)(void) = 0;
 static IBList *servers = 0;
-static IBList *handlers = 0;
+static HandlerIndex handlers[NEVENTTYPES];
+static unsigned nhandlers = 0;
 
 static IrcBotEvent *createBotEvent(IrcBotEventType type, IrcServer *server,
 	const char *origin, const char *command, const char *from,
 	const char *arg);
 static void destroyBotEvent(IrcBotEvent *e);
+static void addToList(HandlerList *l, IrcBotEventHandler *hdl);
+static IrcBotEventHandler *firstMatch(const HandlerList *l,
+	const char *serverId, const char *origin, unsigned limit);
+static void destroyHandlerList(void *list);
+static void clearHandlers(void);
 static IrcBotEventHandler *findHandler(IrcBotEventType type,
 	const char *serverId, const char *origin, const char *filter);
 static void handlerThreadProc(void *arg);
 static void executeHandler(IrcBotEventHandler *hdl, IrcBotEvent *e);
 static void destroyMessage(void *message);
+static void sendResponses(IrcBotEvent *e);
 
 static void handlerJobFinished(void *receiver, void *sender, void *args);
 static void startup(void *receiver, void *sender, void *args);
@@ -97,6 +133,7 @@ static void userJoined(void *receiver, void *sender, void *args);
 static void userParted(void *receiver, void *sender, void *args);
 static void chanJoined(void *receiver, void *sender, void *args);
 static void connected(void *receiver, void *sender, void *args);
+static void batchReceived(void *receiver, void *sender, void *args);
 
 static IrcBotEvent *createBotEvent(IrcBotEventType type, IrcServer *server,
 	const char *origin, const char *command, const char *from,
@@ -115,6 +152,8 @@ static IrcBotEvent *createBotEvent(IrcBotEventType type, IrcServer *server,
     }
     else e->from = 0;
     e->arg = IB_copystr(arg);
+    e->batch = 0;
+    e->children = 0;
     e->response.messages = IBList_create();
     e->type = type;
     return e;
@@ -124,6 +163,7 @@ static void destroyBotEvent(IrcBotEvent *e)
 {
     if (!e) return;
     IBList_destroy(e->response.messages);
+    IrcBatch_unref(e->batch);
     free(e->arg);
     free(e->from);
     free(e->command);
@@ -131,37 +171,78 @@ static void destroyBotEvent(IrcBotEvent *e)
     free(e);
 }
 
-static IrcBotEventHandler *findHandler(IrcBotEventType type,
-	const char *serverId, const char *origin, const char *filter)
+static void addToList(HandlerList *l, IrcBotEventHandler *hdl)
 {
-    if (!handlers) return 0;
-
-    IrcBotEventHandler *hdl = 0;
-    IBListIterator *i = IBList_iterator(handlers);
-    while (IBListIterator_moveNext(i))
+    if (l->n == l->capa)
     {
-	IrcBotEventHandler *h = IBListIterator_current(i);
+	l->capa += HANDLERSCHUNK;
+	l->hdl = IB_xrealloc(l->hdl, l->capa * sizeof *l->hdl);
+    }
+    l->hdl[l->n++] = hdl;
+}
 
-	if (h->type != type)
-	    continue;
+static IrcBotEventHandler *firstMatch(const HandlerList *l,
+	const char *serverId, const char *origin, unsigned limit)
+{
+    for (size_t i = 0; i < l->n && l->hdl[i]->seq < limit; ++i)
+    {
+	IrcBotEventHandler *h = l->hdl[i];
 	if (h->serverId && (!serverId || strcmp(serverId, h->serverId)))
 	    continue;
 	if (h->origin && (!origin || strcmp(origin, h->origin)))
 	    continue;
-	if (h->filter && (!filter || strcmp(filter, h->filter)))
-	    continue;
+	return h;
+    }
+    return 0;
+}
+
+static void destroyHandlerList(void *list)
+{
+    HandlerList *l = list;
+    for (size_t i = 0; i < l->n; ++i) free(l->hdl[i]);
+    free(l->hdl);
+    free(l);
+}
 
-	hdl = h;
-	break;
+static void clearHandlers(void)
+{
+    for (int i = 0; i < NEVENTTYPES; ++i)
+    {
+	IBHashTable_destroy(handlers[i].byFilter);
+	handlers[i].byFilter = 0;
+	for (size_t j = 0; j < handlers[i].any.n; ++j)
+	{
+	    free(handlers[i].any.hdl[j]);
+	}
+	free(handlers[i].any.hdl);
+	handlers[i].any = (HandlerList){ 0, 0, 0 };
     }
-    IBListIterator_destroy(i);
-    return hdl;
+    nhandlers = 0;
+}
+
+static IrcBotEventHandler *findHandler(IrcBotEventType type,
+	const char *serverId, const char *origin, const char *filter)
+{
+    if ((unsigned)type >= NEVENTTYPES) return 0;
+    HandlerIndex *idx = handlers + type;
+
+    IrcBotEventHandler *hdl = 0;
+    if (filter && idx->byFilter)
+    {
+	HandlerList *l = IBHashTable_get(idx->byFilter, filter);
+	if (l) hdl = firstMatch(l, serverId, origin, nhandlers);
+    }
+    IrcBotEventHandler *any = firstMatch(&idx->any, serverId, origin,
+	    hdl ? hdl->seq : nhandlers);
+    return any ? any : hdl;
 }
 
 static void handlerThreadProc(void *arg)
 {
     HandlerThreadProcArg *tparg = arg;
     tparg->hdl->handler(tparg->e);
+    ThreadJobGroup_destroy(tparg->e->children);
+    tparg->e->children = 0;
 }
 
 static void executeHandler(IrcBotEventHandler *hdl, IrcBotEvent *e)
@@ -169,10 +250,42 @@ static void executeHandler(IrcBotEventHandler *hdl, IrcBotEvent *e)
     HandlerThreadProcArg *tparg = IB_xmalloc(sizeof *tparg);
     tparg->hdl = hdl;
     tparg->e = e;
-    ThreadJob *job = ThreadJob_create(handlerThreadProc, tparg, 30);
+    ThreadJob *job = ThreadJob_create(handlerThreadProc, tparg, 30000);
+    if (threadOpts.overloadPolicy == IBOP_COALESCE && !e->batch)
+    {
+	/* identical events get identical responses */
+	char prefix[64];
+	snprintf(prefix, sizeof prefix, "%p %d %p", (void *)hdl,
+		(int)e->type, (void *)e->server);
+	const char *fields[] = { e->origin, e->command, e->from, e->arg };
+	IBStringBuilder *key = IBStringBuilder_create();
+	IBStringBuilder_append(key, prefix);
+	for (size_t i = 0; i < sizeof fields / sizeof *fields; ++i)
+	{
+	    IBStringBuilder_append(key, fields[i] ? "\n+" : "\n-");
+	    if (fields[i]) IBStringBuilder_append(key, fields[i]);
+	}
+	ThreadJob_setKey(job, IBStringBuilder_str(key));
+	IBStringBuilder_destroy(key);
+    }
     Event_register(ThreadJob_finished(job), 0, handlerJobFinished, 0);
-    ThreadPool_enqueue(job);
+    int rc = ThreadPool_enqueue(job);
+    if (rc == 0) return;
 
+    if (rc < 0)
+    {
+	IBLog_msg(L_WARNING, "IrcBot: thread pool overloaded, "
+		"rejected a handler.");
+	if (threadOpts.rejectHandler)
+	{
+	    threadOpts.rejectHandler(e);
+	    sendResponses(e);
+	}
+    }
+    else IBLog_msg(L_DEBUG, "IrcBot: dropped a duplicate bot event.");
+    ThreadJob_destroy(job);
+    destroyBotEvent(e);
+    free(tparg);
 }
 
 static void destroyMessage(void *message)
@@ -184,6 +297,18 @@ static void destroyMessage(void *message)
     free(msg);
 }
 
+static void sendResponses(IrcBotEvent *e)
+{
+    IBListIterator *i = IBList_iterator(e->response.messages);
+    while (IBListIterator_moveNext(i))
+    {
+	IrcBotResponseMessage *message = IBListIterator_current(i);
+	IrcServer_sendMsg(e->server, message->to,
+		message->msg, message->action);
+    }
+    IBListIterator_destroy(i);
+}
+
 static void handlerJobFinished(void *receiver, void *sender, void *args)
 {
     (void)receiver;
@@ -191,17 +316,7 @@ static void handlerJobFinished(void *receiver, void *sender, void *args)
     ThreadJob *job = sender;
     HandlerThreadProcArg *tparg = args;
 
-    if (ThreadJob_hasCompleted(job))
-    {
-	IBListIterator *i = IBList_iterator(tparg->e->response.messages);
-	while (IBListIterator_moveNext(i))
-	{
-	    IrcBotResponseMessage *message = IBListIterator_current(i);
-	    IrcServer_sendMsg(tparg->e->server, message->to,
-		    message->msg, message->action);
-	}
-	IBListIterator_destroy(i);
-    }
+    if (ThreadJob_hasCompleted(job)) sendResponses(tparg->e);
     else IBLog_msg(L_WARNING, "IrcBot: a handler timed out.");
 
     destroyBotEvent(tparg->e);
@@ -228,6 +343,8 @@ static void startup(void *receiver, void *sender, void *args)
 	Event_register(IrcServer_joined(server), 0, chanJoined, 0);
 	Event_register(IrcServer_msgReceived(server), 0,
 		msgReceived, MSG_PRIVMSG);
+	Event_register(IrcServer_batchReceived(server), 0,
+		batchReceived, 0);
     }
     IBListIterator_destroy(i);
 
@@ -279,12 +396,11 @@ static void msgReceived(void *receiver, void *sender, void *args)
 
     IrcServer *server = sender;
     const IrcMessage *msg = args;
-    const IBList *params = IrcMessage_params(msg);
 
-    if (IBList_size(params) != 2) return;
+    if (IrcMessage_paramCount(msg) != 2) return;
     const char *from = IrcMessage_prefix(msg);
-    const char *to = IBList_at(params, 0);
-    const char *message = IBList_at(params, 1);
+    const char *to = IrcMessage_param(msg, 0);
+    const char *message = IrcMessage_param(msg, 1);
 
     IrcChannel *channel = IBHashTable_get(IrcServer_channels(server), to);
 
@@ -339,7 +455,7 @@ static void msgReceived(void *receiver, void *sender, void *args)
     if (hdl)
     {
 	IrcBotEvent *e = createBotEvent(IBET_PRIVMSG, server,
-		to, 0, from, IBList_at(params, 1));
+		to, 0, from, IrcMessage_param(msg, 1));
 	executeHandler(hdl, e);
     }
 }
@@ -411,6 +527,24 @@ static void connected(void *receiver, void *sender, void *args)
     }
 }
 
+static void batchReceived(void *receiver, void *sender, void *args)
+{
+    (void)receiver;
+
+    IrcServer *server = sender;
+    IrcBatch *batch = args;
+    const char *origin = IrcBatch_param(batch, 0);
+    IrcBotEventHandler *hdl = findHandler(IBET_BATCH,
+	    IrcServer_id(server), origin, IrcBatch_type(batch));
+    if (hdl)
+    {
+	IrcBotEvent *e = createBotEvent(IBET_BATCH, server,
+		origin, IrcBatch_type(batch), 0, 0);
+	e->batch = IrcBatch_ref(batch);
+	executeHandler(hdl, e);
+    }
+}
+
 SOEXPORT IBThreadOpts *IrcBot_threadOpts(void)
 {
     return &threadOpts;
@@ -456,6 +590,28 @@ SOEXPORT void IBThreadOpts_setQLenPerThread(IBThreadOpts *self, int num)
     self->qLenPerThread = num;
 }
 
+SOEXPORT void IBThreadOpts_setWorkStealing(IBThreadOpts *self, int enable)
+{
+    self->workStealing = enable;
+}
+
+SOEXPORT void IBThreadOpts_setOverloadPolicy(IBThreadOpts *self,
+	IBOverloadPolicy policy)
+{
+    self->overloadPolicy = policy;
+}
+
+SOEXPORT void IBThreadOpts_setRejectHandler(IBThreadOpts *self,
+	IrcBotHandler handler)
+{
+    self->rejectHandler = handler;
+}
+
+SOEXPORT void IrcBot_threadStats(IBThreadStats *stats)
+{
+    ThreadPool_stats(stats);
+}
+
 SOEXPORT void IrcBot_daemonize(long uid, long gid,
 	const char *pidfile, void (*started)(void))
 {
@@ -480,14 +636,30 @@ SOEXPORT void IrcBot_addHandler(IrcBotEventType eventType,
 	const char *serverId, const char *origin, const char *filter,
 	IrcBotHandler handler)
 {
+    if ((unsigned)eventType >= NEVENTTYPES) return;
     IrcBotEventHandler *hdl = IB_xmalloc(sizeof *hdl);
     hdl->handler = handler;
     hdl->serverId = serverId;
     hdl->origin = origin;
     hdl->filter = filter;
     hdl->type = eventType;
-    if (!handlers) handlers = IBList_create();
-    IBList_append(handlers, hdl, free);
+    hdl->seq = nhandlers++;
+
+    HandlerIndex *idx = handlers + eventType;
+    if (!filter)
+    {
+	addToList(&idx->any, hdl);
+	return;
+    }
+    if (!idx->byFilter) idx->byFilter = IBHashTable_create(4);
+    HandlerList *l = IBHashTable_get(idx->byFilter, filter);
+    if (!l)
+    {
+	l = IB_xmalloc(sizeof *l);
+	*l = (HandlerList){ 0, 0, 0 };
+	IBHashTable_set(idx->byFilter, filter, l, destroyHandlerList);
+    }
+    addToList(l, hdl);
 }
 
 static inline void destroyServer(void *server)
@@ -511,7 +683,6 @@ static int daemonrun(void *data)
 
     if (Service_init(&daemonOpts) >= 0)
     {
-	Service_setTickInterval(1000);
 	Event_register(Service_startup(), 0, startup, 0);
 	Event_register(Service_shutdown(), 0, shutdown, 0);
 
@@ -521,13 +692,16 @@ static int daemonrun(void *data)
 	    ThreadPool_done();
 	}
 
+	/* servers own timers and connections, so they must be gone before
+	 * the service is torn down */
+	IBList_destroy(servers);
+	servers = 0;
 	Service_done();
     }
 
     IBList_destroy(servers);
     servers = 0;
-    IBList_destroy(handlers);
-    handlers = 0;
+    clearHandlers();
 
     return rc;
 }
@@ -574,11 +748,28 @@ SOEXPORT const char *IrcBotEvent_arg(const IrcBotEvent *self)
     return self->arg;
 }
 
+SOEXPORT const IrcBatch *IrcBotEvent_batch(const IrcBotEvent *self)
+{
+    return self->batch;
+}
+
 SOEXPORT IrcBotResponse *IrcBotEvent_response(IrcBotEvent *self)
 {
     return &self->response;
 }
 
+SOEXPORT void IrcBotEvent_spawn(IrcBotEvent *self,
+	IrcBotJobProc proc, void *arg)
+{
+    if (!self->children) self->children = ThreadJobGroup_create();
+    ThreadJobGroup_spawn(self->children, proc, arg);
+}
+
+SOEXPORT void IrcBotEvent_sync(IrcBotEvent *self)
+{
+    if (self->children) ThreadJobGroup_wait(self->children);
+}
+
 SOEXPORT void IrcBotResponse_addMsg(IrcBotResponse *self,
 	const char *to, const char *msg, int action)
 {
@@ -589,3 +780,17 @@ SOEXPORT void IrcBotResponse_addMsg(IrcBotResponse *self,
     IBList_append(self->messages, message, destroyMessage);
 }
 
+SOEXPORT void IrcBotResponse_addMultiMsg(IrcBotResponse *self,
+	const char *const *to, size_t nto, const char *msg, int action)
+{
+    if (!nto) return;
+    IBStringBuilder *targets = IBStringBuilder_create();
+    for (size_t i = 0; i < nto; ++i)
+    {
+	if (i) IBStringBuilder_append(targets, ",");
+	IBStringBuilder_append(targets, to[i]);
+    }
+    IrcBotResponse_addMsg(self, IBStringBuilder_str(targets), msg, action);
+    IBStringBuilder_destroy(targets);
+}
+
@@ -22,6 +22,9 @@ struct IBThreadOpts
     int maxQueueLen;
     int minQueueLen;
     int qLenPerThread;
+    int workStealing;
+    IBOverloadPolicy overloadPolicy;
+    IrcBotHandler rejectHandler;
 };
 
 #endif
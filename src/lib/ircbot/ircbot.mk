@@ -3,21 +3,27 @@ ircbot_MODULES:=		client \
 				daemon \
 				event \
 				hashtable \
+				ircbatch \
 				ircbot \
 				ircchannel \
 				irccommand \
 				ircmessage \
 				ircserver \
+				linescan \
 				list \
 				log \
+				poller \
 				queue \
+				sendqueue \
 				service \
 				stringbuilder \
 				threadpool \
+				timer \
 				util
 
 ircbot_HEADERS_INSTALL:= 	decl \
 				hashtable \
+				ircbatch \
 				ircbot \
 				ircchannel \
 				irccommand \
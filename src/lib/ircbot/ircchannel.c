@@ -1,8 +1,8 @@
 #define _DEFAULT_SOURCE
-#include <ircbot/hashtable.h>
 #include <ircbot/irccommand.h>
 
 #include "event.h"
+#include "hashtable.h"
 #include "ircchannel.h"
 #include "ircmessage.h"
 #include "ircserver.h"
@@ -12,55 +12,69 @@
 #include <stdlib.h>
 #include <string.h>
 
-#define JOINSYNCTICKS 15
-#define REJOINTICKS 30
+#define JOINSYNCTIMEOUT 15000
+#define REJOINTIMEOUT 30000
+#define NICKSBITS 8
+#define NAMESCHUNK 4096
+#define NICKPREFIXES "~&@%+"
 
 struct IrcChannel
 {
     char *name;
     IrcServer *server;
     IBHashTable *nicks;
+    char *names;
+    size_t namesLen;
+    size_t namesCapa;
+    size_t nnames;
     Event *joined;
     Event *parted;
     Event *entered;
     Event *left;
     Event *failed;
+    Timer *joinTimer;
+    EventHandle connectHandle;
+    EventHandle disconnectHandle;
     int isJoined;
     int wantJoined;
-    int joinsyncticks;
-    int rejointicks;
 };
 
 static void joinOnConnect(void *receiver, void *sender, void *args);
 static void disconnected(void *receiver, void *sender, void *args);
-static void waitjoin(void *receiver, void *sender, void *args);
-static void waitrejoin(void *receiver, void *sender, void *args);
-static void handleMsg(void *receiver, void *sender, void *args);
+static void waitjoin(void *receiver, Timer *timer);
+static void waitrejoin(void *receiver, Timer *timer);
+static void stopJoinTimer(IrcChannel *self) CMETHOD;
+static void waitConnect(IrcChannel *self) CMETHOD;
+static void stopWaitConnect(IrcChannel *self) CMETHOD;
+static void watchDisconnect(IrcChannel *self) CMETHOD;
+static void stopWatchDisconnect(IrcChannel *self) CMETHOD;
+static void addNames(IrcChannel *self, const char *list) CMETHOD;
+static void commitNames(IrcChannel *self) CMETHOD;
+static void dropNames(IrcChannel *self) CMETHOD;
+static void clearNicks(IrcChannel *self) CMETHOD;
+static void userLeft(IrcChannel *self, const char *prefix) CMETHOD;
 
 SOLOCAL IrcChannel *IrcChannel_create(IrcServer *server, const char *name)
 {
     IrcChannel *self = IB_xmalloc(sizeof *self);
     self->name = IB_copystr(name);
     self->server = server;
-    self->nicks = IBHashTable_create(8);
+    self->nicks = IBHashTable_createRefKeys(NICKSBITS, 0);
+    IBHashTable_setCaseMapping(self->nicks, IrcServer_caseMapping(server));
+    self->names = 0;
+    self->namesLen = 0;
+    self->namesCapa = 0;
+    self->nnames = 0;
     self->joined = Event_create(self);
     self->parted = Event_create(self);
     self->entered = Event_create(self);
     self->left = Event_create(self);
     self->failed = Event_create(self);
+    self->joinTimer = 0;
+    self->connectHandle = 0;
+    self->disconnectHandle = 0;
     self->isJoined = 0;
     self->wantJoined = 0;
-
-    Event *msgev = IrcServer_msgReceived(server);
-    Event_register(msgev, self, handleMsg, MSG_JOIN);
-    Event_register(msgev, self, handleMsg, MSG_PART);
-    Event_register(msgev, self, handleMsg, MSG_QUIT);
-    Event_register(msgev, self, handleMsg, MSG_NICK);
-    Event_register(msgev, self, handleMsg, MSG_KICK);
-    Event_register(msgev, self, handleMsg, RPL_NAMREPLY);
-    Event_register(msgev, self, handleMsg, RPL_ENDOFNAMES);
-    Event_register(msgev, self, handleMsg, ERR_NOSUCHCHANNEL);
-
     return self;
 }
 
@@ -91,8 +105,7 @@ static void joinOnConnect(void *receiver, void *sender, void *args)
     (void)args;
 
     if (server != self->server) return;
-    Event_unregister(IrcServer_connected(self->server), self,
-	    joinOnConnect, 0);
+    stopWaitConnect(self);
     self->wantJoined = 0;
     IrcChannel_join(self);
 }
@@ -105,16 +118,13 @@ static void disconnected(void *receiver, void *sender, void *args)
 
     if (server != self->server) return;
 
-    Event_unregister(IrcServer_connected(self->server), self,
-	    joinOnConnect, 0);
-    Event_unregister(Service_tick(), self, waitjoin, 0);
-    Event_unregister(Service_tick(), self, waitrejoin, 0);
-    Event_unregister(IrcServer_disconnected(self->server), self,
-	    disconnected, 0);
+    stopWaitConnect(self);
+    stopJoinTimer(self);
+    dropNames(self);
+    stopWatchDisconnect(self);
     if (self->wantJoined)
     {
-	Event_register(IrcServer_connected(self->server), self,
-		joinOnConnect, 0);
+	waitConnect(self);
     }
     if (self->isJoined)
     {
@@ -123,33 +133,57 @@ static void disconnected(void *receiver, void *sender, void *args)
     }
 }
 
-static void waitjoin(void *receiver, void *sender, void *args)
+static void waitjoin(void *receiver, Timer *timer)
 {
-    IrcChannel *self = receiver;
-    (void)sender;
-    (void)args;
+    (void)timer;
 
-    if (!--self->joinsyncticks)
-    {
-	IrcServer_sendCmd(self->server, MSG_PART, self->name);
-	Event_unregister(Service_tick(), self, waitjoin, 0);
-	self->rejointicks = REJOINTICKS;
-	Event_register(Service_tick(), self, waitrejoin, 0);
-    }
+    IrcChannel *self = receiver;
+    IrcServer_sendCmd(self->server, MSG_PART, self->name);
+    self->joinTimer = Service_addTimer(REJOINTIMEOUT, 0, self, waitrejoin);
 }
 
-static void waitrejoin(void *receiver, void *sender, void *args)
+static void waitrejoin(void *receiver, Timer *timer)
 {
+    (void)timer;
+
     IrcChannel *self = receiver;
-    (void)sender;
-    (void)args;
+    self->joinTimer = 0;
+    self->wantJoined = 0;
+    IrcChannel_join(self);
+}
 
-    if (!--self->rejointicks)
-    {
-	Event_unregister(Service_tick(), self, waitrejoin, 0);
-	self->wantJoined = 0;
-	IrcChannel_join(self);
-    }
+static void stopJoinTimer(IrcChannel *self)
+{
+    Service_cancelTimer(self->joinTimer);
+    self->joinTimer = 0;
+}
+
+static void waitConnect(IrcChannel *self)
+{
+    stopWaitConnect(self);
+    self->connectHandle = Event_register(IrcServer_connected(self->server),
+	    self, joinOnConnect, 0);
+}
+
+static void stopWaitConnect(IrcChannel *self)
+{
+    Event_unregisterHandle(IrcServer_connected(self->server),
+	    self->connectHandle);
+    self->connectHandle = 0;
+}
+
+static void watchDisconnect(IrcChannel *self)
+{
+    stopWatchDisconnect(self);
+    self->disconnectHandle = Event_register(
+	    IrcServer_disconnected(self->server), self, disconnected, 0);
+}
+
+static void stopWatchDisconnect(IrcChannel *self)
+{
+    Event_unregisterHandle(IrcServer_disconnected(self->server),
+	    self->disconnectHandle);
+    self->disconnectHandle = 0;
 }
 
 SOLOCAL void IrcChannel_join(IrcChannel *self)
@@ -158,25 +192,26 @@ SOLOCAL void IrcChannel_join(IrcChannel *self)
     self->wantJoined = 1;
     if (IrcServer_sendCmd(self->server, MSG_JOIN, self->name) < 0)
     {
-	Event_register(IrcServer_connected(self->server), self,
-		joinOnConnect, 0);
+	waitConnect(self);
 	return;
     }
-    self->joinsyncticks = JOINSYNCTICKS;
-    Event_register(Service_tick(), self, waitjoin, 0);
-    Event_register(IrcServer_disconnected(self->server), self,
-	    disconnected, 0);
+    stopJoinTimer(self);
+    self->joinTimer = Service_addTimer(JOINSYNCTIMEOUT, 0, self, waitjoin);
+    watchDisconnect(self);
+}
+
+SOLOCAL void IrcChannel_setCaseMapping(IrcChannel *self,
+	IBCaseMapping mapping)
+{
+    IBHashTable_setCaseMapping(self->nicks, mapping);
 }
 
 SOLOCAL void IrcChannel_part(IrcChannel *self)
 {
     self->wantJoined = 0;
-    Event_unregister(IrcServer_connected(self->server), self,
-	    joinOnConnect, 0);
-    Event_unregister(Service_tick(), self, waitjoin, 0);
-    Event_unregister(Service_tick(), self, waitrejoin, 0);
-    Event_unregister(IrcServer_disconnected(self->server), self,
-	    disconnected, 0);
+    stopWaitConnect(self);
+    stopJoinTimer(self);
+    stopWatchDisconnect(self);
 
     if (self->isJoined)
     {
@@ -186,68 +221,161 @@ SOLOCAL void IrcChannel_part(IrcChannel *self)
     }
 }
 
-static void handleMsg(void *receiver, void *sender, void *args)
+/* nicks of a NAMES reply are collected in one buffer of NUL-separated
+ * strings and only entered once the reply is complete, into a table sized
+ * for all of them. The keys of the nicks table are the nicks of the
+ * server's user registry, shared by all channels a user is in. */
+static void addNames(IrcChannel *self, const char *list)
 {
-    IrcChannel *self = receiver;
-    IrcServer *server = sender;
-    const IrcMessage *msg = args;
+    IBCaseMapping cm = IrcServer_caseMapping(self->server);
+    const char *own = IrcServer_nick(self->server);
+    while (*list)
+    {
+	size_t len = strcspn(list, " ");
+	size_t prefixlen = strspn(list, NICKPREFIXES);
+	if (prefixlen > len) prefixlen = len;
+	const char *nick = list + prefixlen;
+	size_t nicklen = len - prefixlen;
+	list += len;
+	while (*list == ' ') ++list;
+	if (!nicklen) continue;
+
+	if (self->namesLen + nicklen + 1 > self->namesCapa)
+	{
+	    self->namesCapa = self->namesCapa
+		? 2 * self->namesCapa : NAMESCHUNK;
+	    self->names = IB_xrealloc(self->names, self->namesCapa);
+	}
+	char *name = self->names + self->namesLen;
+	memcpy(name, nick, nicklen);
+	name[nicklen] = 0;
+	if (strcmpmap(name, own, cm))
+	{
+	    self->namesLen += nicklen + 1;
+	    ++self->nnames;
+	}
+    }
+}
 
-    if (server != self->server) return;
+static void commitNames(IrcChannel *self)
+{
+    IBHashTable *nicks = IBHashTable_createRefKeys(NICKSBITS, self->nnames);
+    IBHashTable_setCaseMapping(nicks, IrcServer_caseMapping(self->server));
+    const char *name = self->names;
+    for (size_t i = 0; i < self->nnames; ++i)
+    {
+	IBHashTable_set(nicks, IrcServer_addMember(self->server, name, self),
+		self->name, 0);
+	name += strlen(name) + 1;
+    }
+
+    /* users missing from the new list aren't on the channel any more */
+    IBHashTableIterator *i = IBHashTable_iterator(self->nicks);
+    while (IBHashTableIterator_moveNext(i))
+    {
+	const char *nick = IBHashTableIterator_key(i);
+	if (!IBHashTable_get(nicks, nick))
+	{
+	    IrcServer_removeMember(self->server, nick, self);
+	}
+    }
+    IBHashTableIterator_destroy(i);
+    IBHashTable_destroy(self->nicks);
+    self->nicks = nicks;
+    dropNames(self);
+}
+
+static void dropNames(IrcChannel *self)
+{
+    free(self->names);
+    self->names = 0;
+    self->namesLen = 0;
+    self->namesCapa = 0;
+    self->nnames = 0;
+}
+
+static void clearNicks(IrcChannel *self)
+{
+    IBHashTableIterator *i = IBHashTable_iterator(self->nicks);
+    while (IBHashTableIterator_moveNext(i))
+    {
+	IrcServer_removeMember(self->server, IBHashTableIterator_key(i), self);
+    }
+    IBHashTableIterator_destroy(i);
+}
 
-    IrcCommand cmd = IrcMessage_command(msg);
-    const IBList *params = IrcMessage_params(msg);
+SOLOCAL void IrcChannel_resetNicks(IrcChannel *self)
+{
+    clearNicks(self);
+    IBHashTable_destroy(self->nicks);
+    self->nicks = IBHashTable_createRefKeys(NICKSBITS, 0);
+    IBHashTable_setCaseMapping(self->nicks,
+	    IrcServer_caseMapping(self->server));
+}
+
+static void userLeft(IrcChannel *self, const char *prefix)
+{
     char buf[128];
+    if (!prefix || sscanf(prefix, "%127[^!]", buf) != 1) return;
+    if (IBHashTable_delete(self->nicks, buf))
+    {
+	Event_raise(self->left, 0, buf);
+	IrcServer_removeMember(self->server, buf, self);
+    }
+}
 
-    switch (cmd)
+SOLOCAL void IrcChannel_removeUser(IrcChannel *self, const char *nick)
+{
+    if (IBHashTable_delete(self->nicks, nick))
     {
-	case MSG_JOIN:
-	    if (IBList_size(params) && !strcmp(IBList_at(params, 0), self->name))
-	    {
-		sscanf(IrcMessage_prefix(msg), "%127[^!]", buf);
-		if (strcmp(buf, IrcServer_nick(self->server)))
-		{
-		    IBHashTable_set(self->nicks, buf, self->name, 0);
-		    Event_raise(self->entered, 0, buf);
-		}
-	    }
-	    break;
+	Event_raise(self->left, 0, (char *)nick);
+    }
+}
 
-	case MSG_PART:
-	    if (!IBList_size(params) || strcmp(IBList_at(params, 0), self->name))
-		break;
-	    ATTR_FALLTHROUGH;
-	case MSG_QUIT:
+SOLOCAL void IrcChannel_renameUser(IrcChannel *self,
+	const char *oldnick, const char *newnick)
+{
+    if (IBHashTable_delete(self->nicks, oldnick))
+    {
+	IBHashTable_set(self->nicks, newnick, self->name, 0);
+    }
+}
+
+SOLOCAL void IrcChannel_handleMessage(IrcChannel *self,
+	const IrcMessage *msg)
+{
+    IBCaseMapping cm = IrcServer_caseMapping(self->server);
+    char buf[128];
+
+    switch (IrcMessage_command(msg))
+    {
+	case MSG_JOIN:
 	    sscanf(IrcMessage_prefix(msg), "%127[^!]", buf);
-	    if (IBHashTable_delete(self->nicks, buf))
+	    if (strcmpmap(buf, IrcServer_nick(self->server), cm))
 	    {
-		Event_raise(self->left, 0, buf);
+		IBHashTable_set(self->nicks,
+			IrcServer_addMember(self->server, buf, self),
+			self->name, 0);
+		Event_raise(self->entered, 0, buf);
 	    }
 	    break;
 
-	case MSG_NICK:
-	    if (IBList_size(params) == 1)
-	    {
-		sscanf(IrcMessage_prefix(msg), "%127[^!]", buf);
-		if (IBHashTable_delete(self->nicks, buf))
-		{
-		    IBHashTable_set(self->nicks, IBList_at(params, 0),
-			    self->name, 0);
-		}
-	    }
+	case MSG_PART:
+	    userLeft(self, IrcMessage_prefix(msg));
 	    break;
 
 	case MSG_KICK:
-	    if (IBList_size(params) > 1
-		    && !strcmp(IBList_at(params, 0), self->name))
+	    if (IrcMessage_paramCount(msg) > 1)
 	    {
-		const char *nick = IBList_at(params, 1);
-		if (!strcmp(nick, IrcServer_nick(self->server)))
+		const char *nick = IrcMessage_param(msg, 1);
+		if (!strcmpmap(nick, IrcServer_nick(self->server), cm))
 		{
 		    self->isJoined = 0;
 		    if (self->wantJoined)
 		    {
-			self->rejointicks = REJOINTICKS;
-			Event_register(Service_tick(), self, waitrejoin, 0);
+			stopJoinTimer(self);
+			self->joinTimer = Service_addTimer(REJOINTIMEOUT, 0,
+				self, waitrejoin);
 		    }
 		    Event_raise(self->parted, 0, 0);
 		}
@@ -256,53 +384,32 @@ static void handleMsg(void *receiver, void *sender, void *args)
 		    char *ea = IB_copystr(nick);
 		    Event_raise(self->left, 0, ea);
 		    free(ea);
+		    IrcServer_removeMember(self->server, nick, self);
 		}
 	    }
 	    break;
 
 	case RPL_NAMREPLY:
-	    if (IBList_size(params) == 4
-		    && !strcmp(IBList_at(params, 2), self->name))
+	    if (IrcMessage_paramCount(msg) == 4)
 	    {
-		char *nicklist = IB_copystr(IBList_at(params, 3));
-		char *i = nicklist;
-		char *nick = strsep(&i, " ");
-		while (nick)
-		{
-		    if (*nick && ((*nick != '@' && *nick != '%'
-				    && *nick != '@') || *++nick)
-			    && strcmp(nick, IrcServer_nick(self->server)))
-		    {
-			IBHashTable_set(self->nicks, nick, self->name, 0);
-		    }
-		    nick = strsep(&i, " ");
-		}
-		free(nicklist);
+		addNames(self, IrcMessage_param(msg, 3));
 	    }
 	    break;
 
 	case RPL_ENDOFNAMES:
-	    if (IBList_size(params) > 1
-		    && !strcmp(IBList_at(params, 1), self->name))
-	    {
-		self->isJoined = 1;
-		Event_unregister(Service_tick(), self, waitjoin, 0);
-		Event_unregister(Service_tick(), self, waitrejoin, 0);
-		Event_raise(self->joined, 0, 0);
-	    }
+	    /* the nick list is replaced at once, so it's never seen half
+	     * complete */
+	    commitNames(self);
+	    self->isJoined = 1;
+	    stopJoinTimer(self);
+	    Event_raise(self->joined, 0, 0);
 	    break;
 
 	case ERR_NOSUCHCHANNEL:
-	    if (IBList_size(params) && !strcmp(IBList_at(params, 0), self->name))
-	    {
-		Event_unregister(IrcServer_connected(self->server), self,
-			joinOnConnect, 0);
-		Event_unregister(Service_tick(), self, waitjoin, 0);
-		Event_unregister(Service_tick(), self, waitrejoin, 0);
-		Event_unregister(IrcServer_disconnected(self->server), self,
-			disconnected, 0);
-		Event_raise(self->failed, 0, 0);
-	    }
+	    stopWaitConnect(self);
+	    stopJoinTimer(self);
+	    stopWatchDisconnect(self);
+	    Event_raise(self->failed, 0, 0);
 	    break;
 
 	default: ;
@@ -337,20 +444,14 @@ SOLOCAL Event *IrcChannel_failed(IrcChannel *self)
 SOLOCAL void IrcChannel_destroy(IrcChannel *self)
 {
     if (!self) return;
-    Event *msgev = IrcServer_msgReceived(self->server);
-    Event_unregister(msgev, self, handleMsg, ERR_NOSUCHCHANNEL);
-    Event_unregister(msgev, self, handleMsg, RPL_ENDOFNAMES);
-    Event_unregister(msgev, self, handleMsg, RPL_NAMREPLY);
-    Event_unregister(msgev, self, handleMsg, MSG_KICK);
-    Event_unregister(msgev, self, handleMsg, MSG_NICK);
-    Event_unregister(msgev, self, handleMsg, MSG_QUIT);
-    Event_unregister(msgev, self, handleMsg, MSG_PART);
-    Event_unregister(msgev, self, handleMsg, MSG_JOIN);
+    stopJoinTimer(self);
+    free(self->names);
     Event_destroy(self->failed);
     Event_destroy(self->left);
     Event_destroy(self->entered);
     Event_destroy(self->parted);
     Event_destroy(self->joined);
+    clearNicks(self);
     IBHashTable_destroy(self->nicks);
     free(self->name);
     free(self);
@@ -1,15 +1,27 @@
 #ifndef IRCBOT_INT_IRCCHANNEL_H
 #define IRCBOT_INT_IRCCHANNEL_H
 
+#include <ircbot/hashtable.h>
 #include <ircbot/ircchannel.h>
 
 C_CLASS_DECL(Event);
+C_CLASS_DECL(IrcMessage);
 
 IrcChannel *IrcChannel_create(IrcServer *server, const char *name)
     ATTR_NONNULL((1)) ATTR_NONNULL((2)) ATTR_RETNONNULL;
 void IrcChannel_destroy(IrcChannel *self);
 void IrcChannel_join(IrcChannel *self) CMETHOD;
 void IrcChannel_part(IrcChannel *self) CMETHOD;
+void IrcChannel_setCaseMapping(IrcChannel *self, IBCaseMapping mapping)
+    CMETHOD;
+void IrcChannel_handleMessage(IrcChannel *self, const IrcMessage *msg)
+    CMETHOD ATTR_NONNULL((2));
+void IrcChannel_resetNicks(IrcChannel *self) CMETHOD;
+void IrcChannel_removeUser(IrcChannel *self, const char *nick)
+    CMETHOD ATTR_NONNULL((2));
+void IrcChannel_renameUser(IrcChannel *self,
+	const char *oldnick, const char *newnick)
+    CMETHOD ATTR_NONNULL((2)) ATTR_NONNULL((3));
 Event *IrcChannel_joined(IrcChannel *self) CMETHOD;
 Event *IrcChannel_parted(IrcChannel *self) CMETHOD;
 Event *IrcChannel_entered(IrcChannel *self) CMETHOD;
@@ -6,95 +6,164 @@
 #include "ircmessage.h"
 #include "util.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
-struct IrcMessage
-{
-    char *prefix;
-    char *rawCmd;
-    char *rawParams;
-    IBList *params;
-    IrcCommand command;
-};
-
-SOLOCAL IrcMessage *IrcMessage_create(
-	const uint8_t *buf, uint16_t size, uint16_t *pos)
+static void parseTags(IrcMessage *self, char *tags) CMETHOD ATTR_NONNULL((2));
+
+static void parseTags(IrcMessage *self, char *tags)
 {
-    uint16_t endpos = (uint16_t)-1;
-    for (uint16_t s = *pos; s < size-1; ++s)
+    /* key[=value] separated by ';', values are unescaped in place, which
+     * never makes them longer */
+    while (tags && self->ntags < IRCMSG_MAXTAGS)
     {
-	if (buf[s] == 0xd && buf[s+1] == 0xa)
+	char *next = strchr(tags, ';');
+	if (next) *next++ = 0;
+	if (*tags)
 	{
-	    endpos = s;
-	    break;
+	    IrcMessageTag *tag = self->tags + self->ntags++;
+	    tag->key = tags;
+	    char *v = strchr(tags, '=');
+	    if (v)
+	    {
+		*v++ = 0;
+		tag->value = v;
+		char *w = v;
+		for (; *v; ++v)
+		{
+		    if (*v != '\\')
+		    {
+			*w++ = *v;
+			continue;
+		    }
+		    switch (*++v)
+		    {
+			case ':': *w++ = ';'; break;
+			case 's': *w++ = ' '; break;
+			case 'r': *w++ = '\r'; break;
+			case 'n': *w++ = '\n'; break;
+			case 0: --v; break;
+			default: *w++ = *v;
+		    }
+		}
+		*w = 0;
+	    }
+	    else tag->value = "";
 	}
+	tags = next;
     }
-    if (endpos == (uint16_t)-1) return 0;
-    if (endpos == *pos)
+}
+
+SOLOCAL void IrcMessage_parse(IrcMessage *self, char *line, size_t len)
+{
+    IBLog_fmt(L_DEBUG, "IrcMessage: received %.*s", (int)len, line);
+
+    /* all parts are views into the line, terminated in place, so the
+     * byte following the line (normally the CR) is overwritten */
+    char *end = line + len;
+    *end = 0;
+    self->prefix = 0;
+    self->rawParamsView = 0;
+    self->rawParamsLen = 0;
+    self->rawParams = 0;
+    self->paramList = 0;
+    self->nparams = 0;
+    self->ntags = 0;
+
+    char *p = line;
+    char *e;
+    if (*p == '@')
     {
-	*pos = endpos + 2;
-	return 0;
+	++p;
+	e = memchr(p, ' ', end - p);
+	if (!e) e = end;
+	if (e < end) *e++ = 0;
+	parseTags(self, p);
+	p = e;
+	while (p < end && *p == ' ') ++p;
+    }
+    if (*p == ':')
+    {
+	++p;
+	e = memchr(p, ' ', end - p);
+	if (!e) e = end;
+	if (e > p) self->prefix = p;
+	if (e < end) *e++ = 0;
+	p = e;
     }
 
-    IBLog_fmt(L_DEBUG, "IrcMessage: received %.*s",
-	    (int)(endpos - *pos), (const char *)buf + *pos);
-
-    uint16_t currpos = *pos;
-    *pos = endpos + 2;
-
-    IrcMessage *self = IB_xmalloc(sizeof *self);
+    e = memchr(p, ' ', end - p);
+    if (!e) e = end;
+    self->rawCmd = p;
+    if (e < end) *e++ = 0;
+    p = e;
+    self->command = IrcCommand_parse(self->rawCmd);
 
-    uint16_t e;
-    if (buf[currpos] == (uint8_t)':')
+    if (p == end) return;
+    self->rawParamsView = p;
+    self->rawParamsLen = end - p;
+    while (p)
     {
-	for (e = ++currpos; e < endpos; ++e)
+	if (*p == ':')
 	{
-	    if (buf[e] == 0x20) break;
+	    self->params[self->nparams++] = p + 1;
+	    break;
 	}
-	if (e > currpos)
+	if (self->nparams == IRCMSG_MAXPARAMS - 1)
 	{
-	    self->prefix = IB_xmalloc(e-currpos+1);
-	    memcpy(self->prefix, buf+currpos, e-currpos);
-	    self->prefix[e-currpos] = 0;
+	    self->params[self->nparams++] = p;
+	    break;
 	}
-	else self->prefix = 0;
-	currpos = e;
-	if (buf[currpos] == 0x20) ++currpos;
+	self->params[self->nparams++] = p;
+	e = memchr(p, ' ', end - p);
+	if (e)
+	{
+	    *e = 0;
+	    p = e + 1;
+	}
+	else p = 0;
     }
-    else self->prefix = 0;
+}
 
-    for (e = currpos; e < endpos; ++e)
+SOEXPORT const char *IrcMessage_tag(const IrcMessage *self, const char *key)
+{
+    for (size_t i = 0; i < self->ntags; ++i)
     {
-	if (buf[e] == 0x20) break;
+	if (!strcmp(self->tags[i].key, key)) return self->tags[i].value;
     }
-    self->rawCmd = IB_xmalloc(e-currpos+1);
-    memcpy(self->rawCmd, buf+currpos, e-currpos);
-    self->rawCmd[e-currpos] = 0;
-    self->command = IrcCommand_parse(self->rawCmd);
-    currpos = e;
-    if (buf[currpos] == 0x20) ++currpos;
+    return 0;
+}
 
-    self->params = IBList_create();
-    if (currpos < endpos)
+SOEXPORT uint64_t IrcMessage_time(const IrcMessage *self)
+{
+    const char *stamp = IrcMessage_tag(self, "time");
+    if (!stamp) return 0;
+
+    /* server-time uses ISO 8601 in UTC, e.g. 2011-10-19T16:40:51.620Z */
+    struct tm tm = { 0 };
+    unsigned ms = 0;
+    int len = 0;
+    if (sscanf(stamp, "%4d-%2d-%2dT%2d:%2d:%2d%n", &tm.tm_year, &tm.tm_mon,
+		&tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &len) < 6)
+    {
+	return 0;
+    }
+    if (stamp[len] == '.')
     {
-	self->rawParams = IB_xmalloc(endpos-currpos+1);
-	memcpy(self->rawParams, buf+currpos, endpos-currpos);
-	self->rawParams[endpos-currpos] = 0;
-	for (char *p = self->rawParams; p;)
+	unsigned scale = 100;
+	for (const char *d = stamp + len + 1; *d >= '0' && *d <= '9'; ++d)
 	{
-	    if (*p == ':')
-	    {
-		IBList_append(self->params, IB_copystr(++p), free);
-		break;
-	    }
-	    else IBList_append(self->params, IB_copystr(strsep(&p, " ")), free);
+	    ms += (*d - '0') * scale;
+	    scale /= 10;
 	}
-	memcpy(self->rawParams, buf+currpos, endpos-currpos);
     }
-    else self->rawParams = 0;
-
-    return self;
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    time_t secs = timegm(&tm);
+    if (secs < 0) return 0;
+    return (uint64_t)secs * 1000 + ms;
 }
 
 SOEXPORT const char *IrcMessage_prefix(const IrcMessage *self)
@@ -112,23 +181,56 @@ SOEXPORT const char *IrcMessage_rawCmd(const IrcMessage *self)
     return self->rawCmd;
 }
 
+SOEXPORT size_t IrcMessage_paramCount(const IrcMessage *self)
+{
+    return self->nparams;
+}
+
+SOEXPORT const char *IrcMessage_param(const IrcMessage *self, size_t i)
+{
+    if (i >= self->nparams) return 0;
+    return self->params[i];
+}
+
 SOEXPORT const IBList *IrcMessage_params(const IrcMessage *self)
 {
-    return self->params;
+    if (!self->paramList)
+    {
+	/* only built on demand, the strings are still owned by the line */
+	IrcMessage *m = (IrcMessage *)self;
+	m->paramList = IBList_create();
+	for (size_t i = 0; i < self->nparams; ++i)
+	{
+	    IBList_append(m->paramList, (void *)self->params[i], 0);
+	}
+    }
+    return self->paramList;
 }
 
 SOEXPORT const char *IrcMessage_rawParams(const IrcMessage *self)
 {
+    if (!self->rawParamsView) return 0;
+    if (!self->rawParams)
+    {
+	/* parameters were split in place, so restore the separators in a
+	 * copy */
+	IrcMessage *m = (IrcMessage *)self;
+	m->rawParams = IB_xmalloc(self->rawParamsLen + 1);
+	memcpy(m->rawParams, self->rawParamsView, self->rawParamsLen);
+	for (size_t i = 0; i < self->rawParamsLen; ++i)
+	{
+	    if (!m->rawParams[i]) m->rawParams[i] = ' ';
+	}
+	m->rawParams[self->rawParamsLen] = 0;
+    }
     return self->rawParams;
 }
 
-SOLOCAL void IrcMessage_destroy(IrcMessage *self)
+SOLOCAL void IrcMessage_done(IrcMessage *self)
 {
     if (!self) return;
-    free(self->prefix);
-    free(self->rawCmd);
     free(self->rawParams);
-    IBList_destroy(self->params);
-    free(self);
+    IBList_destroy(self->paramList);
+    self->rawParams = 0;
+    self->paramList = 0;
 }
-
@@ -5,10 +5,34 @@
 #include <ircbot/ircmessage.h>
 #include <ircbot/list.h>
 
-#include <stdint.h>
+#include <stddef.h>
 
-IrcMessage *IrcMessage_create(const uint8_t *buf, uint16_t size, uint16_t *pos)
-    ATTR_NONNULL((1)) ATTR_NONNULL((3));
-void IrcMessage_destroy(IrcMessage *self);
+#define IRCMSG_MAXPARAMS 15
+#define IRCMSG_MAXTAGS 16
+
+typedef struct IrcMessageTag
+{
+    const char *key;
+    const char *value;
+} IrcMessageTag;
+
+struct IrcMessage
+{
+    IrcMessageTag tags[IRCMSG_MAXTAGS];
+    const char *prefix;
+    const char *rawCmd;
+    const char *params[IRCMSG_MAXPARAMS];
+    const char *rawParamsView;
+    size_t rawParamsLen;
+    char *rawParams;
+    IBList *paramList;
+    IrcCommand command;
+    size_t nparams;
+    size_t ntags;
+};
+
+void IrcMessage_parse(IrcMessage *self, char *line, size_t len)
+    CMETHOD ATTR_NONNULL((2));
+void IrcMessage_done(IrcMessage *self);
 
 #endif
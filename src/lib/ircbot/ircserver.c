@@ -1,16 +1,18 @@
-#include <ircbot/hashtable.h>
 #include <ircbot/irccommand.h>
 #include <ircbot/log.h>
 #include <ircbot/list.h>
-#include <ircbot/queue.h>
 
 #include "client.h"
 #include "clientopts.h"
 #include "connection.h"
 #include "event.h"
+#include "hashtable.h"
+#include "ircbatch.h"
 #include "ircchannel.h"
 #include "ircmessage.h"
+#include "linescan.h"
 #include "ircserver.h"
+#include "sendqueue.h"
 #include "service.h"
 #include "util.h"
 
@@ -21,12 +23,56 @@
 #include <sys/types.h>
 #include <unistd.h>
 
-#define RECONNTICKS 300
-#define QUICKRECONNTICKS 5
-#define LOGINTICKS 20
-#define IDLETICKS 180
-#define PINGTICKS 3
-#define FULLSENDCREDIT 9
+#define RECONNTIMEOUT 300000
+#define QUICKRECONNTIMEOUT 5000
+#define LOGINTIMEOUT 20000
+#define IDLETIMEOUT 180000
+#define PINGTIMEOUT 3000
+#define DEFMAXLINELENGTH 8191
+#define MINMAXLINELENGTH 510
+#define MAXMAXLINELENGTH 65536
+#define LINEBATCH 64
+#define SENDCHUNKSZ 2048
+#define NSENDCHUNKS 4
+#define MAXTARGETSLEN 255
+#define MAXMSGTARGETS 16
+#define DEFUSERHOSTLEN 74
+#define MINMSGCHUNK 64
+#define USERCHANSCHUNK 4
+
+/* IRCv3 capabilities requested from the server */
+#define CAP_MESSAGETAGS (1U << 0)
+#define CAP_BATCH (1U << 1)
+#define CAP_SERVERTIME (1U << 2)
+#define CAP_ECHOMESSAGE (1U << 3)
+#define CAP_LABELEDRESPONSE (1U << 4)
+
+static const char *const capNames[] = {
+    "message-tags",
+    "batch",
+    "server-time",
+    "echo-message",
+    "labeled-response"
+};
+#define NCAPS (sizeof capNames / sizeof *capNames)
+
+/* a user seen in any of our channels, the nick is shared as the key of
+ * the registry and of the nick tables of all these channels */
+typedef struct IrcUser
+{
+    IrcChannel **chans;
+    size_t nchans;
+    size_t capa;
+    char nick[];
+} IrcUser;
+
+/* lines are packed into chunks, each chunk is one write record of the
+ * connection, so a burst reaches the socket with a single writev() */
+typedef struct SendChunk
+{
+    uint16_t len;
+    char data[SENDCHUNKSZ];
+} SendChunk;
 
 struct IrcServer {
     const char *id;
@@ -40,27 +86,39 @@ struct IrcServer {
     const char *user;
     const char *realname;
     IBHashTable *channels;
+    IBHashTable *users;
+    IBHashTable *batches;
     Connection *conn;
-    IBQueue *sendQueue;
+    SendQueue *sendQueue;
     Event *connected;
     Event *disconnected;
     Event *msgReceived;
+    Event *batchReceived;
     Event *joined;
     Event *parted;
-    char *sendcmd;
+    Timer *loginTimer;
+    Timer *reconnTimer;
+    Timer *idleTimer;
+    Timer *sendTimer;
+    uint64_t lastRecv;
+    size_t maxLineLength;
+    size_t userHostLen;
+    IBCaseMapping caseMapping;
     ClientProto proto;
+    unsigned chunkBase;
+    unsigned nChunks;
+    unsigned targMax;
+    unsigned caps;
+    unsigned capsOffered;
     int port;
 #ifdef WITH_TLS
     int tls;
 #endif
-    int sending;
     int connst;
-    int loginticks;
-    int reconnticks;
-    int idleticks;
-    int sendcreditticks;
-    uint16_t recvbufsz;
-    uint8_t recvbuf[8192];
+    int pingSent;
+    int capNegotiating;
+    int discarding;
+    SendChunk sendChunks[NSENDCHUNKS];
 };
 
 #define servername(s) ((s)->name ? (s)->name : (s)->remotehost)
@@ -69,15 +127,37 @@ static void connConnected(void *receiver, void *sender, void *args);
 static void connClosed(void *receiver, void *sender, void *args);
 static void connDataReceived(void *receiver, void *sender, void *args);
 static void connDataSent(void *receiver, void *sender, void *args);
-static void connWaitReconn(void *receiver, void *sender, void *args);
-static void connWaitLogin(void *receiver, void *sender, void *args);
-static void activeTick(void *receiver, void *sender, void *args);
+static void reconnTimeout(void *receiver, Timer *timer);
+static void loginTimeout(void *receiver, Timer *timer);
+static void idleTimeout(void *receiver, Timer *timer);
+static void sendTimeout(void *receiver, Timer *timer);
 static void chanJoined(void *receiver, void *sender, void *args);
 static void chanParted(void *receiver, void *sender, void *args);
 static void chanFailed(void *receiver, void *sender, void *args);
 
-static void sendRaw(IrcServer *self, const char *command);
+static void stopTimers(IrcServer *self);
+static int isOwnPrefix(const IrcServer *self, const char *prefix);
+static int prefixNick(const char *prefix, char *nick, size_t size);
+static int hasChannel(const IrcUser *user, const IrcChannel *channel);
+static void userQuit(IrcServer *self, const char *prefix);
+static void userRenamed(IrcServer *self, const char *prefix,
+	const char *newnick);
+static void learnUserHost(IrcServer *self, const char *prefix);
+static void setTargMax(IrcServer *self, const char *value);
+static void setCaseMapping(IrcServer *self, const char *name);
+static unsigned parseCaps(const char *list, unsigned *removed);
+static void handleCap(IrcServer *self, const IrcMessage *msg);
+static int batchMessage(IrcServer *self, const IrcMessage *msg,
+	char **line, size_t len);
+static void finishBatch(IrcServer *self, IrcBatch *batch);
+static size_t handleLines(IrcServer *self, uint8_t *buf, size_t size);
+static void sendNext(IrcServer *self);
+static char *reserveLine(IrcServer *self, SendPriority prio);
+static void sendLine(IrcServer *self, SendPriority prio,
+	const char *target, char *line, size_t len);
 static void sendRawCmd(IrcServer *self, IrcCommand cmd, const char *args);
+static int sendMsgChunks(IrcServer *self, const char *targets, size_t tlen,
+	const char *message, int action);
 static void handleMessage(IrcServer *self, const IrcMessage *msg);
 
 SOEXPORT IrcServer *IrcServer_create(const char *id,
@@ -99,17 +179,38 @@ SOEXPORT IrcServer *IrcServer_create(const char *id,
     self->user = user;
     self->realname = realname;
     self->channels = IBHashTable_create(6);
+    self->caseMapping = IBCM_RFC1459;
+    IBHashTable_setCaseMapping(self->channels, self->caseMapping);
+    self->users = IBHashTable_createRefKeys(6, 0);
+    IBHashTable_setCaseMapping(self->users, self->caseMapping);
+    self->batches = IBHashTable_create(4);
     self->conn = 0;
-    self->sendQueue = 0;
+    self->sendQueue = SendQueue_create();
+    SendQueue_setCaseMapping(self->sendQueue, self->caseMapping);
     self->connected = Event_create(self);
     self->disconnected = Event_create(self);
-    self->msgReceived = Event_create(self);
+    /* keyed by IrcCommand, so a message only reaches the handlers
+     * interested in its command, e.g. not every channel's JOIN handler
+     * for each PRIVMSG */
+    self->msgReceived = Event_createKeyed(self);
+    self->batchReceived = Event_create(self);
     self->joined = Event_create(self);
     self->parted = Event_create(self);
-    self->sendcmd = 0;
-    self->sending = 0;
+    self->loginTimer = 0;
+    self->reconnTimer = 0;
+    self->idleTimer = 0;
+    self->sendTimer = 0;
+    self->lastRecv = 0;
+    self->maxLineLength = DEFMAXLINELENGTH;
+    self->userHostLen = 0;
+    self->targMax = 1;
+    self->caps = 0;
+    self->capsOffered = 0;
+    self->capNegotiating = 0;
+    self->chunkBase = 0;
+    self->nChunks = 0;
     self->connst = 0;
-    self->recvbufsz = 0;
+    self->discarding = 0;
     return self;
 }
 
@@ -133,6 +234,24 @@ SOEXPORT void IrcServer_useIpv6(IrcServer *self)
     self->proto = CP_IPv6;
 }
 
+SOEXPORT void IrcServer_setMaxLineLength(IrcServer *self, size_t len)
+{
+    if (len < MINMAXLINELENGTH) len = MINMAXLINELENGTH;
+    if (len > MAXMAXLINELENGTH) len = MAXMAXLINELENGTH;
+    self->maxLineLength = len;
+}
+
+SOEXPORT void IrcServer_setSendRate(IrcServer *self,
+	unsigned burst, unsigned msPerLine)
+{
+    SendQueue_setRate(self->sendQueue, burst, msPerLine);
+}
+
+SOEXPORT void IrcServer_sendStats(const IrcServer *self, IBSendStats *stats)
+{
+    SendQueue_stats(self->sendQueue, stats);
+}
+
 static void connConnected(void *receiver, void *sender, void *args)
 {
     IrcServer *self = receiver;
@@ -147,11 +266,15 @@ static void connConnected(void *receiver, void *sender, void *args)
 		connDataReceived, 0);
 	Event_register(Connection_dataSent(self->conn), self,
 		connDataSent, 0);
-	self->sendQueue = IBQueue_create();
-	self->sendcreditticks = FULLSENDCREDIT;
+	SendQueue_fill(self->sendQueue, Service_now());
+	self->userHostLen = 0;
+	self->targMax = 1;
+	self->caps = 0;
+	self->capsOffered = 0;
+	self->discarding = 0;
 	self->connst = -1;
-	self->loginticks = LOGINTICKS;
-	Event_register(Service_tick(), self, connWaitLogin, 0);
+	self->loginTimer = Service_addTimer(LOGINTIMEOUT, 0,
+		self, loginTimeout);
     }
 }
 
@@ -163,16 +286,28 @@ static void connClosed(void *receiver, void *sender, void *args)
     if (conn == self->conn)
     {
 	self->conn = 0;
-	self->reconnticks = args ? QUICKRECONNTICKS : RECONNTICKS;
 	self->connst = 0;
-	IBQueue_destroy(self->sendQueue);
-	self->sendQueue = 0;
+	stopTimers(self);
+	SendQueue_clear(self->sendQueue);
+	IBHashTable_destroy(self->batches);
+	self->batches = IBHashTable_create(4);
+	self->chunkBase = 0;
+	self->nChunks = 0;
 	Event_raise(self->disconnected, 0, 0);
+
+	/* nick lists are rebuilt after rejoining, a rejoin might also fail */
+	IBHashTableIterator *i = IBHashTable_iterator(self->channels);
+	while (IBHashTableIterator_moveNext(i))
+	{
+	    IrcChannel_resetNicks(IBHashTableIterator_current(i));
+	}
+	IBHashTableIterator_destroy(i);
 	IBLog_fmt(L_INFO, "IrcServer: [%s] disconnected", servername(self));
 	free(self->name);
 	self->name = 0;
-	Event_unregister(Service_tick(), self, connWaitLogin, 0);
-	Event_register(Service_tick(), self, connWaitReconn, 0);
+	self->reconnTimer = Service_addTimer(
+		args ? QUICKRECONNTIMEOUT : RECONNTIMEOUT, 0,
+		self, reconnTimeout);
     }
 }
 
@@ -184,39 +319,19 @@ static void connDataReceived(void *receiver, void *sender, void *args)
 
     if (conn != self->conn) return;
 
-    self->idleticks = IDLETICKS;
-
-    memcpy(self->recvbuf + self->recvbufsz, dra->buf, dra->size);
-    self->recvbufsz += dra->size;
-    uint16_t pos = 0;
-    uint16_t oldpos = (uint16_t)-1;
-    while (oldpos != pos)
-    {
-	oldpos = pos;
-	IrcMessage *msg = IrcMessage_create(self->recvbuf,
-		self->recvbufsz, &pos);
-	if (msg) handleMessage(self, msg);
-	IrcMessage_destroy(msg);
-    }
-    if (pos == self->recvbufsz)
-    {
-	self->recvbufsz = 0;
-    }
-    else if (self->recvbufsz - pos > 4096)
-    {
-	IBLog_fmt(L_ERROR, "IrcServer: [%s] protocol error.", servername(self));
-	self->recvbufsz = 0;
-    }
-    else
-    {
-	memmove(self->recvbuf, self->recvbuf + pos, self->recvbufsz - pos);
-	self->recvbufsz -= pos;
-    }
+    self->lastRecv = Service_now();
+    dra->consumed = handleLines(self, dra->buf, dra->size);
+    if (conn != self->conn) return;
 
     if (self->connst == -1)
     {
 	IBLog_fmt(L_INFO, "IrcServer: [%s] sending login data ...",
 		servername(self));
+
+	/* servers without IRCv3 support reply with an error and just
+	 * continue the registration */
+	sendRawCmd(self, MSG_CAP, "LS 302");
+	self->capNegotiating = 1;
 	sendRawCmd(self, MSG_NICK, self->nick);
 	const char *user = self->user;
 	const char *realname = self->realname;
@@ -263,72 +378,71 @@ static void connDataSent(void *receiver, void *sender, void *args)
 {
     IrcServer *self = receiver;
     Connection *conn = sender;
-    (void) args;
 
-    if (conn == self->conn)
+    /* records complete in order, so this is always the oldest chunk */
+    if (conn == self->conn && self->nChunks
+	    && args == self->sendChunks + self->chunkBase)
     {
 	IBLog_msg(L_DEBUG, "IrcServer: sending confirmed");
-	free(self->sendcmd);
-	self->sendcmd = 0;
-	self->sending = 0;
-	sendRaw(self, 0);
+	if (++self->chunkBase == NSENDCHUNKS) self->chunkBase = 0;
+	--self->nChunks;
+	sendNext(self);
     }
 }
 
-static void connWaitReconn(void *receiver, void *sender, void *args)
+static void reconnTimeout(void *receiver, Timer *timer)
 {
-    IrcServer *self = receiver;
-    (void)sender;
-    (void)args;
+    (void)timer;
 
-    if (--self->reconnticks <= 0)
+    IrcServer *self = receiver;
+    self->reconnTimer = 0;
+    IBLog_fmt(L_INFO, "IrcServer: [%s] reconnecting ...", servername(self));
+    if (IrcServer_connect(self) < 0)
     {
-	IBLog_fmt(L_INFO, "IrcServer: [%s] reconnecting ...", servername(self));
-	if (IrcServer_connect(self) < 0)
-	{
-	    self->reconnticks = RECONNTICKS;
-	}
-	else
-	{
-	    Event_unregister(Service_tick(), self, connWaitReconn, 0);
-	}
+	self->reconnTimer = Service_addTimer(RECONNTIMEOUT, 0,
+		self, reconnTimeout);
     }
 }
 
-static void connWaitLogin(void *receiver, void *sender, void *args)
+static void loginTimeout(void *receiver, Timer *timer)
 {
-    IrcServer *self = receiver;
-    (void)sender;
-    (void)args;
+    (void)timer;
 
-    if (--self->loginticks <= 0)
-    {
-	Event_unregister(Service_tick(), self, connWaitLogin, 0);
-	IBLog_fmt(L_WARNING,
-		"IrcServer: [%s] timeout waiting for login, disconnecting ...",
-		servername(self));
-	Connection_close(self->conn, 1);
-    }
+    IrcServer *self = receiver;
+    self->loginTimer = 0;
+    IBLog_fmt(L_WARNING,
+	    "IrcServer: [%s] timeout waiting for login, disconnecting ...",
+	    servername(self));
+    Connection_close(self->conn, 1);
 }
 
-static void activeTick(void *receiver, void *sender, void *args)
+static void idleTimeout(void *receiver, Timer *timer)
 {
-    IrcServer *self = receiver;
-    (void)sender;
-    (void)args;
+    (void)timer;
 
-    if (self->sendcreditticks < FULLSENDCREDIT) ++self->sendcreditticks;
-    sendRaw(self, 0);
+    IrcServer *self = receiver;
+    self->idleTimer = 0;
 
-    if (--self->idleticks == 0)
+    /* receiving data doesn't touch the timer, so check how long the
+     * connection was actually idle */
+    uint64_t idle = Service_now() - self->lastRecv;
+    if (idle < IDLETIMEOUT)
+    {
+	self->pingSent = 0;
+	self->idleTimer = Service_addTimer(IDLETIMEOUT - idle, 0,
+		self, idleTimeout);
+    }
+    else if (!self->pingSent)
     {
 	IBLog_fmt(L_INFO, "IrcServer: [%s] pinging idle connection ...",
 		servername(self));
 	sendRawCmd(self, MSG_PING, self->nick);
+	self->pingSent = 1;
+	self->idleTimer = Service_addTimer(PINGTIMEOUT, 0,
+		self, idleTimeout);
     }
-    else if (self->idleticks <= -PINGTICKS)
+    else
     {
-	Event_unregister(Service_tick(), self, activeTick, 0);
 	IBLog_fmt(L_WARNING,
 		"IrcServer: [%s] timeout waiting for pong, disconnecting ...",
 		servername(self));
@@ -336,6 +450,27 @@ static void activeTick(void *receiver, void *sender, void *args)
     }
 }
 
+static void sendTimeout(void *receiver, Timer *timer)
+{
+    (void)timer;
+
+    IrcServer *self = receiver;
+    self->sendTimer = 0;
+    sendNext(self);
+}
+
+static void stopTimers(IrcServer *self)
+{
+    Service_cancelTimer(self->loginTimer);
+    Service_cancelTimer(self->reconnTimer);
+    Service_cancelTimer(self->idleTimer);
+    Service_cancelTimer(self->sendTimer);
+    self->loginTimer = 0;
+    self->reconnTimer = 0;
+    self->idleTimer = 0;
+    self->sendTimer = 0;
+}
+
 static void chanJoined(void *receiver, void *sender, void *args)
 {
     IrcServer *self = receiver;
@@ -360,36 +495,434 @@ static void chanFailed(void *receiver, void *sender, void *args)
     IrcChannel *chan = sender;
     (void) args;
 
-    const char *channel = IrcChannel_name(chan);
+    /* the channel is still raising this event, it's removed by
+     * handleMessage() when it's done with the message */
     Event_unregister(IrcChannel_joined(chan), self, chanJoined, 0);
     Event_unregister(IrcChannel_parted(chan), self, chanParted, 0);
     Event_unregister(IrcChannel_failed(chan), self, chanFailed, 0);
-    IrcChannel_destroy(chan);
-    IBHashTable_delete(self->channels, channel);
 }
 
-static void sendRaw(IrcServer *self, const char *command)
+static int isOwnPrefix(const IrcServer *self, const char *prefix)
+{
+    if (!prefix) return 0;
+    size_t nicklen = strlen(self->nick);
+    return !strncmpmap(prefix, self->nick, nicklen, self->caseMapping)
+	&& strcspn(prefix, "!") == nicklen;
+}
+
+static int prefixNick(const char *prefix, char *nick, size_t size)
+{
+    if (!prefix) return 0;
+    size_t len = strcspn(prefix, "!");
+    if (!len || len >= size) return 0;
+    memcpy(nick, prefix, len);
+    nick[len] = 0;
+    return 1;
+}
+
+static int hasChannel(const IrcUser *user, const IrcChannel *channel)
+{
+    for (size_t i = 0; i < user->nchans; ++i)
+    {
+	if (user->chans[i] == channel) return 1;
+    }
+    return 0;
+}
+
+static void userQuit(IrcServer *self, const char *prefix)
+{
+    char nick[128];
+    if (!prefixNick(prefix, nick, sizeof nick)) return;
+    IrcUser *user = IBHashTable_get(self->users, nick);
+    if (!user) return;
+
+    IBHashTable_delete(self->users, nick);
+    for (size_t i = 0; i < user->nchans; ++i)
+    {
+	IrcChannel_removeUser(user->chans[i], user->nick);
+    }
+    free(user->chans);
+    free(user);
+}
+
+static void userRenamed(IrcServer *self, const char *prefix,
+	const char *newnick)
+{
+    char nick[128];
+    if (!prefixNick(prefix, nick, sizeof nick)) return;
+    IrcUser *user = IBHashTable_get(self->users, nick);
+    if (!user) return;
+
+    /* a user already known as newnick must be stale (e.g. a missed QUIT),
+     * otherwise the server wouldn't allow the rename */
+    IrcUser *stale = IBHashTable_get(self->users, newnick);
+    if (stale == user) stale = 0;
+    if (stale)
+    {
+	IBHashTable_delete(self->users, stale->nick);
+	for (size_t i = 0; i < stale->nchans; ++i)
+	{
+	    if (!hasChannel(user, stale->chans[i]))
+	    {
+		IrcChannel_removeUser(stale->chans[i], stale->nick);
+	    }
+	}
+    }
+
+    size_t len = strlen(newnick);
+    IrcUser *renamed = IB_xmalloc(sizeof *renamed + len + 1);
+    renamed->chans = user->chans;
+    renamed->nchans = user->nchans;
+    renamed->capa = user->capa;
+    memcpy(renamed->nick, newnick, len + 1);
+    IBHashTable_delete(self->users, nick);
+    IBHashTable_set(self->users, renamed->nick, renamed, 0);
+    /* in channels shared with a stale user, this also replaces the stale
+     * key with the renamed user's nick */
+    for (size_t i = 0; i < renamed->nchans; ++i)
+    {
+	IrcChannel_renameUser(renamed->chans[i], user->nick, renamed->nick);
+    }
+    free(user);
+    if (stale)
+    {
+	free(stale->chans);
+	free(stale);
+    }
+}
+
+static void learnUserHost(IrcServer *self, const char *prefix)
+{
+    if (!isOwnPrefix(self, prefix)) return;
+    const char *userhost = strchr(prefix, '!');
+    if (userhost) self->userHostLen = strlen(userhost + 1);
+}
+
+static void setTargMax(IrcServer *self, const char *value)
+{
+    /* e.g. PRIVMSG:4,NOTICE:4,JOIN:, a missing limit means unlimited */
+    while (value && *value)
+    {
+	if (!strncmp(value, "PRIVMSG:", 8))
+	{
+	    unsigned long max = isdigit((unsigned char)value[8])
+		? strtoul(value + 8, 0, 10) : MAXMSGTARGETS;
+	    if (max > MAXMSGTARGETS) max = MAXMSGTARGETS;
+	    self->targMax = max ? max : 1;
+	    return;
+	}
+	if ((value = strchr(value, ','))) ++value;
+    }
+}
+
+static void setCaseMapping(IrcServer *self, const char *name)
+{
+    IBCaseMapping mapping;
+    if (!strcmp(name, "rfc1459")) mapping = IBCM_RFC1459;
+    else if (!strcmp(name, "strict-rfc1459")) mapping = IBCM_STRICTRFC1459;
+    else if (!strcmp(name, "ascii") || !strcmp(name, "rfc7613"))
+    {
+	/* rfc7613 folds non-ASCII as well, that part isn't supported */
+	mapping = IBCM_ASCII;
+    }
+    else
+    {
+	IBLog_fmt(L_WARNING, "IrcServer: [%s] unknown casemapping `%s'",
+		servername(self), name);
+	return;
+    }
+    if (mapping == self->caseMapping) return;
+    self->caseMapping = mapping;
+    IBHashTable_setCaseMapping(self->channels, mapping);
+    /* users are forgotten on disconnect and the server announces this
+     * before we join anything, so no nicks can become equal here */
+    IBHashTable_setCaseMapping(self->users, mapping);
+    SendQueue_setCaseMapping(self->sendQueue, mapping);
+    IBHashTableIterator *i = IBHashTable_iterator(self->channels);
+    while (IBHashTableIterator_moveNext(i))
+    {
+	IrcChannel_setCaseMapping(IBHashTableIterator_current(i), mapping);
+    }
+    IBHashTableIterator_destroy(i);
+}
+
+static unsigned parseCaps(const char *list, unsigned *removed)
+{
+    unsigned caps = 0;
+    while (*list)
+    {
+	size_t len = strcspn(list, " ");
+	int remove = *list == '-';
+	const char *name = list + remove;
+	size_t namelen = strcspn(name, " =");
+	for (size_t i = 0; i < NCAPS; ++i)
+	{
+	    if (strlen(capNames[i]) == namelen
+		    && !strncmp(capNames[i], name, namelen))
+	    {
+		if (remove && removed) *removed |= 1U << i;
+		else if (!remove) caps |= 1U << i;
+	    }
+	}
+	list += len;
+	while (*list == ' ') ++list;
+    }
+    return caps;
+}
+
+static void handleCap(IrcServer *self, const IrcMessage *msg)
+{
+    size_t n = IrcMessage_paramCount(msg);
+    if (n < 3) return;
+    const char *sub = IrcMessage_param(msg, 1);
+    const char *list = IrcMessage_param(msg, n - 1);
+    unsigned removed = 0;
+
+    if (!strcmp(sub, "LS"))
+    {
+	self->capsOffered |= parseCaps(list, 0);
+
+	/* a '*' before the list means more lines are following */
+	if (n > 3 && !strcmp(IrcMessage_param(msg, 2), "*")) return;
+	if (!self->capNegotiating) return;
+
+	/* labeled-response is only useful with batches */
+	unsigned want = self->capsOffered;
+	if (!(want & CAP_BATCH)) want &= ~CAP_LABELEDRESPONSE;
+	if (!want)
+	{
+	    sendRawCmd(self, MSG_CAP, "END");
+	    self->capNegotiating = 0;
+	    return;
+	}
+	char req[128] = "REQ :";
+	for (size_t i = 0; i < NCAPS; ++i)
+	{
+	    if (!(want & 1U << i)) continue;
+	    if (req[5]) strcat(req, " ");
+	    strcat(req, capNames[i]);
+	}
+	sendRawCmd(self, MSG_CAP, req);
+    }
+    else if (!strcmp(sub, "ACK") || !strcmp(sub, "NAK")
+	    || !strcmp(sub, "DEL"))
+    {
+	if (*sub == 'A') self->caps |= parseCaps(list, &removed);
+	else if (*sub == 'D') removed = parseCaps(list, 0);
+	self->caps &= ~removed;
+	if (*sub != 'D' && self->capNegotiating)
+	{
+	    IBLog_fmt(L_DEBUG, "IrcServer: [%s] capabilities: %x",
+		    servername(self), self->caps);
+	    sendRawCmd(self, MSG_CAP, "END");
+	    self->capNegotiating = 0;
+	}
+    }
+}
+
+static inline void unrefBatch(void *batch)
+{
+    IrcBatch_unref(batch);
+}
+
+static int batchMessage(IrcServer *self, const IrcMessage *msg,
+	char **line, size_t len)
+{
+    const char *outer = IrcMessage_tag(msg, "batch");
+    IrcBatch *batch = outer ? IBHashTable_get(self->batches, outer) : 0;
+
+    if (IrcMessage_command(msg) == MSG_IRCBATCH && IrcMessage_paramCount(msg))
+    {
+	const char *ref = IrcMessage_param(msg, 0);
+	if (*ref == '+' && ref[1])
+	{
+	    /* a nested batch is collected as part of the outer one */
+	    if (batch)
+	    {
+		IBHashTable_set(self->batches, ref + 1, IrcBatch_ref(batch),
+			unrefBatch);
+	    }
+	    else
+	    {
+		IBHashTable_set(self->batches, ref + 1, IrcBatch_create(msg),
+			unrefBatch);
+		return 1;
+	    }
+	}
+	else if (*ref == '-' && ref[1])
+	{
+	    IrcBatch *closed = IBHashTable_get(self->batches, ref + 1);
+	    if (!closed) return 1;
+	    IrcBatch_ref(closed);
+	    IBHashTable_delete(self->batches, ref + 1);
+	    if (closed != batch)
+	    {
+		finishBatch(self, closed);
+		return 1;
+	    }
+	    IrcBatch_unref(closed);
+	}
+    }
+
+    if (!batch || !*line) return 0;
+    IrcBatch_add(batch, *line, len);
+    *line = 0;
+    return 1;
+}
+
+static void finishBatch(IrcServer *self, IrcBatch *batch)
 {
-    if (command)
+    /* history is only delivered as a whole, commands in there must not be
+     * handled again */
+    const char *type = IrcBatch_type(batch);
+    Connection *conn = self->conn;
+    if (strcmp(type, "chathistory") && strcmp(type, "znc.in/playback"))
     {
-	IBQueue_enqueue(self->sendQueue, IB_copystr(command), free);
+	for (size_t i = 0; i < IrcBatch_messageCount(batch)
+		&& conn == self->conn; ++i)
+	{
+	    const IrcMessage *msg = IrcBatch_message(batch, i);
+	    if (IrcMessage_command(msg) != MSG_IRCBATCH) handleMessage(self, msg);
+	}
     }
-    if (self->sendcreditticks < 2 || self->sending) return;
-    if ((self->sendcmd = IBQueue_dequeue(self->sendQueue)))
+
+    /* raised last, so the batch isn't touched any more while handlers
+     * might already look at it */
+    if (conn == self->conn) Event_raise(self->batchReceived, 0, batch);
+    IrcBatch_unref(batch);
+}
+
+static size_t handleLines(IrcServer *self, uint8_t *buf, size_t size)
+{
+    Connection *conn = self->conn;
+    size_t ends[LINEBATCH];
+    size_t pos = 0;
+    size_t nends = LINEBATCH;
+    while (nends == LINEBATCH && conn == self->conn)
     {
-	IBLog_fmt(L_DEBUG, "IrcServer: sending %s", self->sendcmd);
-	self->sending = 1;
-	self->sendcreditticks -= 2;
-	Connection_write(self->conn, (const uint8_t *)self->sendcmd,
-		(uint16_t)strlen(self->sendcmd), self);
+	nends = LineScan_ends(buf, pos, size, ends, LINEBATCH);
+	for (size_t i = 0; i < nends && conn == self->conn; ++i)
+	{
+	    size_t len = ends[i] - 1 - pos;
+	    if (self->discarding) self->discarding = 0;
+	    else if (len > self->maxLineLength)
+	    {
+		IBLog_fmt(L_ERROR, "IrcServer: [%s] protocol error, "
+			"line too long.", servername(self));
+	    }
+	    else if (len)
+	    {
+		char *line = (char *)buf + pos;
+		char *copy = 0;
+		if (*line == '@' && IBHashTable_count(self->batches))
+		{
+		    /* parsing is destructive, keep the line in case it's
+		     * part of an open batch */
+		    copy = IB_xmalloc(len + 1);
+		    memcpy(copy, line, len);
+		}
+		IrcMessage msg;
+		IrcMessage_parse(&msg, line, len);
+		if (!batchMessage(self, &msg, &copy, len))
+		{
+		    handleMessage(self, &msg);
+		}
+		free(copy);
+		IrcMessage_done(&msg);
+	    }
+	    pos = ends[i] + 1;
+	}
     }
+
+    /* the rest is a partial line that stays in the connection's buffer,
+     * unless it can't become a valid line any more */
+    if (!self->discarding && size - pos > self->maxLineLength + 1)
+    {
+	IBLog_fmt(L_ERROR, "IrcServer: [%s] protocol error, line too long.",
+		servername(self));
+	self->discarding = 1;
+    }
+    if (self->discarding)
+    {
+	/* keep a trailing CR, the LF ending the discarded line might only
+	 * arrive with the next read */
+	pos = size && buf[size - 1] == '\r' ? size - 1 : size;
+    }
+    return pos;
+}
+
+static void sendNext(IrcServer *self)
+{
+    uint64_t now = Service_now();
+    unsigned wait = 0;
+    while (self->conn && self->nChunks < NSENDCHUNKS
+	    && Connection_writeRecsFree(self->conn))
+    {
+	SendChunk *chunk = self->sendChunks
+	    + (self->chunkBase + self->nChunks) % NSENDCHUNKS;
+	chunk->len = 0;
+	const char *line;
+	uint16_t len;
+	while (SENDCHUNKSZ - chunk->len >= SENDLINEMAX
+		&& (line = SendQueue_next(self->sendQueue, now, &len, &wait)))
+	{
+	    IBLog_fmt(L_DEBUG, "IrcServer: sending %.*s", (int)len, line);
+	    memcpy(chunk->data + chunk->len, line, len);
+	    chunk->len += len;
+	    SendQueue_release(self->sendQueue, line);
+	}
+	if (!chunk->len) break;
+	Connection_write(self->conn, (const uint8_t *)chunk->data,
+		chunk->len, chunk);
+	++self->nChunks;
+    }
+    if (wait && !self->sendTimer)
+    {
+	self->sendTimer = Service_addTimer(wait, 0, self, sendTimeout);
+    }
+}
+
+static char *reserveLine(IrcServer *self, SendPriority prio)
+{
+    char *line = SendQueue_reserve(self->sendQueue, prio);
+    if (!line)
+    {
+	IBLog_fmt(L_WARNING, "IrcServer: [%s] send queue full, "
+		"dropping message", servername(self));
+    }
+    return line;
+}
+
+static void sendLine(IrcServer *self, SendPriority prio,
+	const char *target, char *line, size_t len)
+{
+    SendQueue_commit(self->sendQueue, prio, target, line, len);
+    sendNext(self);
 }
 
 static void sendRawCmd(IrcServer *self, IrcCommand cmd, const char *args)
 {
-    char buf[513];
-    snprintf(buf, 513, "%s %s\r\n", IrcCommand_str(cmd), args);
-    sendRaw(self, buf);
+    /* only keepalive and registration skip the rate limit. Commands are
+     * scheduled per target like messages, so e.g. a PART doesn't overtake
+     * replies to the same channel, and QUIT waits for everything else */
+    SendPriority prio = SP_REPLY;
+    if (cmd == MSG_PONG || cmd == MSG_PING || self->connst < 0)
+    {
+	prio = SP_CONTROL;
+    }
+    else if (cmd == MSG_QUIT) prio = SP_FINAL;
+    char *line = reserveLine(self, prio);
+    if (!line) return;
+    int len = snprintf(line, SENDLINEMAX + 1, "%s %s\r\n",
+	    IrcCommand_str(cmd), args);
+    if (len > SENDLINEMAX) len = SENDLINEMAX;
+    if (prio == SP_REPLY)
+    {
+	char target[256];
+	if (*args == ':' || sscanf(args, "%255s", target) != 1) *target = 0;
+	sendLine(self, prio, target, line, len);
+    }
+    else sendLine(self, prio, 0, line, len);
 }
 
 static inline void destroyIrcChannel(void *chan)
@@ -400,25 +933,73 @@ static inline void destroyIrcChannel(void *chan)
 static void handleMessage(IrcServer *self, const IrcMessage *msg)
 {
     IrcCommand cmd = IrcMessage_command(msg);
-    const IBList *params = IrcMessage_params(msg);
 
     switch (cmd)
     {
+	case MSG_CAP:
+	    handleCap(self, msg);
+	    break;
+
+	case MSG_PRIVMSG:
+	case MSG_NOTICE:
+	    /* with echo-message, the server confirms our own messages, they
+	     * must not look like messages sent to us */
+	    if ((self->caps & CAP_ECHOMESSAGE)
+		    && isOwnPrefix(self, IrcMessage_prefix(msg)))
+	    {
+		IBLog_msg(L_DEBUG, "IrcServer: message delivered");
+		return;
+	    }
+	    break;
+
+	case RPL_WELCOME:
+	    /* the text usually ends with our full nick!user@host */
+	    if (IrcMessage_paramCount(msg) > 1)
+	    {
+		const char *text = IrcMessage_param(msg,
+			IrcMessage_paramCount(msg) - 1);
+		const char *word = strrchr(text, ' ');
+		learnUserHost(self, word ? word + 1 : text);
+	    }
+	    break;
+
 	case RPL_MYINFO:
-	    if (IBList_size(params) > 2)
+	    if (IrcMessage_paramCount(msg) > 2)
 	    {
 		free(self->name);
-		self->name = IB_copystr(IBList_at(params, 1));
+		self->name = IB_copystr(IrcMessage_param(msg, 1));
 		IBLog_fmt(L_INFO, "IrcServer: [%s] connected and logged in",
 			self->name);
 		self->connst = 1;
-		self->sendcreditticks = FULLSENDCREDIT;
-		Event_unregister(Service_tick(), self, connWaitLogin, 0);
-		Event_register(Service_tick(), self, activeTick, 0);
+		SendQueue_fill(self->sendQueue, Service_now());
+		Service_cancelTimer(self->loginTimer);
+		self->loginTimer = 0;
+		self->pingSent = 0;
+		if (!self->idleTimer)
+		{
+		    self->idleTimer = Service_addTimer(IDLETIMEOUT, 0,
+			    self, idleTimeout);
+		}
 		Event_raise(self->connected, 0, 0);
 	    }
 	    break;
 
+	case RPL_BOUNCE:
+	    /* RPL_ISUPPORT in practice, the last parameter is a comment */
+	    for (size_t i = 1; i + 1 < IrcMessage_paramCount(msg); ++i)
+	    {
+		const char *token = IrcMessage_param(msg, i);
+		if (!strncmp(token, "CASEMAPPING=", 12))
+		{
+		    setCaseMapping(self, token + 12);
+		}
+		else if (!strncmp(token, "TARGMAX=", 8))
+		{
+		    setTargMax(self, token + 8);
+		}
+	    }
+	    break;
+
 	case ERR_NICKNAMEINUSE:
 	    {
 		size_t nicklen = strlen(self->nick);
@@ -433,29 +1014,33 @@ static void handleMessage(IrcServer *self, const IrcMessage *msg)
 	    break;
 
 	case MSG_NICK:
-	    if (IBList_size(params)
-		    && !strncmp(IrcMessage_prefix(msg),
-			self->nick, strlen(self->nick))
-		    && strcspn(IrcMessage_prefix(msg),
-			"!") == strlen(self->nick))
+	    if (IrcMessage_paramCount(msg)
+		    && isOwnPrefix(self, IrcMessage_prefix(msg)))
 	    {
 		free(self->nick);
-		self->nick = IB_copystr(IBList_at(params, 0));
+		self->nick = IB_copystr(IrcMessage_param(msg, 0));
+	    }
+	    else if (IrcMessage_paramCount(msg) == 1)
+	    {
+		userRenamed(self, IrcMessage_prefix(msg),
+			IrcMessage_param(msg, 0));
 	    }
 	    break;
 
+	case MSG_QUIT:
+	    userQuit(self, IrcMessage_prefix(msg));
+	    break;
+
 	case MSG_JOIN:
-	    if (IBList_size(params)
-		    && !strncmp(IrcMessage_prefix(msg),
-			self->nick, strlen(self->nick))
-		    && strcspn(IrcMessage_prefix(msg),
-			"!") == strlen(self->nick))
+	    if (IrcMessage_paramCount(msg)
+		    && isOwnPrefix(self, IrcMessage_prefix(msg)))
 	    {
-		const char *chan = IBList_at(params, 0);
+		learnUserHost(self, IrcMessage_prefix(msg));
+		const char *chan = IrcMessage_param(msg, 0);
 		if (!IBHashTable_get(self->channels, chan))
 		{
 		    IrcChannel *channel = IrcChannel_create(self,
-			    IBList_at(params, 0));
+			    IrcMessage_param(msg, 0));
 		    Event_register(IrcChannel_joined(channel), self,
 			    chanJoined, 0);
 		    Event_register(IrcChannel_parted(channel), self,
@@ -471,6 +1056,34 @@ static void handleMessage(IrcServer *self, const IrcMessage *msg)
 	default: ;
     }
 
+    /* messages about one channel only go to that channel */
+    const char *chan = 0;
+    switch (cmd)
+    {
+	case MSG_JOIN:
+	case MSG_PART:
+	case MSG_KICK:
+	    chan = IrcMessage_param(msg, 0);
+	    break;
+
+	case RPL_NAMREPLY:
+	    chan = IrcMessage_param(msg, 2);
+	    break;
+
+	case RPL_ENDOFNAMES:
+	case ERR_NOSUCHCHANNEL:
+	    chan = IrcMessage_param(msg, 1);
+	    break;
+
+	default: ;
+    }
+    IrcChannel *channel = chan ? IBHashTable_get(self->channels, chan) : 0;
+    if (channel)
+    {
+	IrcChannel_handleMessage(channel, msg);
+	if (cmd == ERR_NOSUCHCHANNEL) IBHashTable_delete(self->channels, chan);
+    }
+
     Event_raise(self->msgReceived, cmd, (void *)msg);
 }
 
@@ -495,6 +1108,7 @@ SOLOCAL int IrcServer_connect(IrcServer *self)
     };
     self->conn = Connection_createTcpClient(&opts);
     if (!self->conn) return -1;
+    Connection_setMaxReadBuffer(self->conn, 2 * (self->maxLineLength + 2));
     Event_register(Connection_connected(self->conn), self, connConnected, 0);
     Event_register(Connection_closed(self->conn), self, connClosed, 0);
     return 0;
@@ -502,8 +1116,10 @@ SOLOCAL int IrcServer_connect(IrcServer *self)
 
 SOLOCAL void IrcServer_disconnect(IrcServer *self)
 {
-    Event_unregister(Service_tick(), self, connWaitLogin, 0);
-    Event_unregister(Service_tick(), self, connWaitReconn, 0);
+    Service_cancelTimer(self->loginTimer);
+    Service_cancelTimer(self->reconnTimer);
+    self->loginTimer = 0;
+    self->reconnTimer = 0;
     if (self->connst > 0) sendRawCmd(self, MSG_QUIT, ":bye.");
     else if (self->conn) Connection_close(self->conn, 0);
 }
@@ -528,6 +1144,11 @@ SOEXPORT const IBHashTable *IrcServer_channels(const IrcServer *self)
     return self->channels;
 }
 
+SOLOCAL IBCaseMapping IrcServer_caseMapping(const IrcServer *self)
+{
+    return self->caseMapping;
+}
+
 SOLOCAL void IrcServer_setNick(IrcServer *self, const char *nick)
 {
     if (strcmp(nick, self->nick))
@@ -564,7 +1185,6 @@ SOEXPORT void IrcServer_part(IrcServer *self, const char *channel)
 	Event_unregister(IrcChannel_joined(chan), self, chanJoined, 0);
 	Event_unregister(IrcChannel_parted(chan), self, chanParted, 0);
 	Event_unregister(IrcChannel_failed(chan), self, chanFailed, 0);
-	IrcChannel_destroy(chan);
 	IBHashTable_delete(self->channels, channel);
     }
 }
@@ -577,35 +1197,100 @@ SOLOCAL int IrcServer_sendCmd(IrcServer *self, IrcCommand cmd,
     return 0;
 }
 
-SOLOCAL int IrcServer_sendMsg(IrcServer *self,
-	const char *to, const char *message, int action)
+static size_t splitMsg(const char *message, size_t msglen, size_t maxchunk)
 {
-    if (self->connst <= 0) return -1;
-    if (strlen(to) > 255)
+    if (msglen <= maxchunk) return msglen;
+
+    /* prefer a word boundary, unless it leaves a very short line */
+    for (size_t i = maxchunk; i > maxchunk / 2; --i)
     {
-	IBLog_fmt(L_ERROR, "IrcServer: [%s] Invalid message recipient %s",
-		servername(self), to);
-	return -1;
+	if (message[i] == ' ') return i;
     }
-    char rawmsg[513];
+
+    /* otherwise, never cut inside of an UTF-8 sequence */
+    size_t i = maxchunk;
+    while (i > maxchunk / 2 && ((unsigned char)message[i] & 0xc0) == 0x80) --i;
+    return i;
+}
+
+static int sendMsgChunks(IrcServer *self, const char *targets, size_t tlen,
+	const char *message, int action)
+{
     const char *cmd = IrcCommand_str(MSG_PRIVMSG);
-    int idx = sprintf(rawmsg,
-	    action ? "%s %s :\001ACTION " : "%s %s :", cmd, to);
-    size_t maxchunk = sizeof rawmsg - idx - 3 - !!action;
+    const char *fmt = action ? "%s %s :\001ACTION " : "%s %s :";
+    size_t idx = strlen(cmd) + tlen + (action ? 11 : 3);
+    size_t room = SENDLINEMAX - idx - 2 - !!action;
+
+    /* the server relays the line with ":nick!user@host " in front, and
+     * the result must still fit in 512 bytes */
+    size_t prefixlen = strlen(self->nick) + 3
+	+ (self->userHostLen ? self->userHostLen : DEFUSERHOSTLEN);
+    size_t maxchunk = room > prefixlen + MINMSGCHUNK
+	? room - prefixlen : MINMSGCHUNK;
+
     size_t msglen = strlen(message);
-    char *tgt = rawmsg + idx;
+    SendPriority prio = SP_REPLY;
     while (msglen)
     {
-	size_t chunksz = (msglen > maxchunk) ? maxchunk : msglen;
-	strncpy(tgt, message, chunksz);
-	strcpy(tgt+chunksz, &"\001\r\n"[!action]);
-	sendRaw(self, rawmsg);
+	size_t chunksz = splitMsg(message, msglen, maxchunk);
+	char *line = reserveLine(self, prio);
+	if (!line) return -1;
+	sprintf(line, fmt, cmd, targets);
+	memcpy(line + idx, message, chunksz);
+	strcpy(line + idx + chunksz, &"\001\r\n"[!action]);
+	sendLine(self, prio, targets, line, idx + chunksz + 2 + !!action);
+	prio = SP_BULK;
 	message += chunksz;
 	msglen -= chunksz;
+	if (msglen && *message == ' ')
+	{
+	    ++message;
+	    --msglen;
+	}
     }
     return 0;
 }
 
+SOLOCAL int IrcServer_sendMsg(IrcServer *self,
+	const char *to, const char *message, int action)
+{
+    if (self->connst <= 0) return -1;
+
+    /* to can list several targets separated by commas, they are grouped
+     * as far as the server accepts multiple targets (TARGMAX) */
+    char targets[MAXTARGETSLEN + 1];
+    int rc = 0;
+    while (*to)
+    {
+	size_t len = 0;
+	unsigned n = 0;
+	while (*to && n < self->targMax)
+	{
+	    size_t toklen = strcspn(to, ",");
+	    if (toklen > MAXTARGETSLEN)
+	    {
+		IBLog_fmt(L_ERROR, "IrcServer: [%s] Invalid message "
+			"recipient %.*s", servername(self), (int)toklen, to);
+		rc = -1;
+	    }
+	    else if (toklen)
+	    {
+		if (len + !!len + toklen > MAXTARGETSLEN) break;
+		if (len) targets[len++] = ',';
+		memcpy(targets + len, to, toklen);
+		len += toklen;
+		++n;
+	    }
+	    to += toklen;
+	    if (*to == ',') ++to;
+	}
+	if (!len) continue;
+	targets[len] = 0;
+	if (sendMsgChunks(self, targets, len, message, action) < 0) return -1;
+    }
+    return rc;
+}
+
 SOLOCAL Event *IrcServer_connected(IrcServer *self)
 {
     return self->connected;
@@ -621,11 +1306,62 @@ SOLOCAL Event *IrcServer_msgReceived(IrcServer *self)
     return self->msgReceived;
 }
 
+SOLOCAL Event *IrcServer_batchReceived(IrcServer *self)
+{
+    return self->batchReceived;
+}
+
 SOLOCAL Event *IrcServer_joined(IrcServer *self)
 {
     return self->joined;
 }
 
+SOLOCAL const char *IrcServer_addMember(IrcServer *self, const char *nick,
+	IrcChannel *channel)
+{
+    IrcUser *user = IBHashTable_get(self->users, nick);
+    if (!user)
+    {
+	size_t len = strlen(nick);
+	user = IB_xmalloc(sizeof *user + len + 1);
+	user->chans = 0;
+	user->nchans = 0;
+	user->capa = 0;
+	memcpy(user->nick, nick, len + 1);
+	IBHashTable_set(self->users, user->nick, user, 0);
+    }
+    if (hasChannel(user, channel)) return user->nick;
+    if (user->nchans == user->capa)
+    {
+	user->capa += USERCHANSCHUNK;
+	user->chans = IB_xrealloc(user->chans,
+		user->capa * sizeof *user->chans);
+    }
+    user->chans[user->nchans++] = channel;
+    return user->nick;
+}
+
+SOLOCAL void IrcServer_removeMember(IrcServer *self, const char *nick,
+	IrcChannel *channel)
+{
+    IrcUser *user = IBHashTable_get(self->users, nick);
+    if (!user) return;
+    for (size_t i = 0; i < user->nchans; ++i)
+    {
+	if (user->chans[i] == channel)
+	{
+	    user->chans[i] = user->chans[--user->nchans];
+	    break;
+	}
+    }
+    if (!user->nchans)
+    {
+	IBHashTable_delete(self->users, user->nick);
+	free(user->chans);
+	free(user);
+    }
+}
+
 SOEXPORT void IrcServer_destroy(IrcServer *self)
 {
     if (!self) return;
@@ -640,16 +1376,20 @@ SOEXPORT void IrcServer_destroy(IrcServer *self)
 	Event_unregister(Connection_closed(self->conn), self,
 		connClosed, 0);
 	IrcServer_disconnect(self);
-	IBQueue_destroy(self->sendQueue);
 	Connection_close(self->conn, 0);
     }
+    stopTimers(self);
+    /* channels remove their users from the registry */
+    IBHashTable_destroy(self->channels);
+    IBHashTable_destroy(self->users);
+    IBHashTable_destroy(self->batches);
     Event_destroy(self->connected);
     Event_destroy(self->disconnected);
     Event_destroy(self->msgReceived);
+    Event_destroy(self->batchReceived);
     Event_destroy(self->joined);
     Event_destroy(self->parted);
-    IBHashTable_destroy(self->channels);
-    free(self->sendcmd);
+    SendQueue_destroy(self->sendQueue);
     free(self->name);
     free(self->nick);
     free(self);
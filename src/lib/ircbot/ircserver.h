@@ -1,10 +1,12 @@
 #ifndef IRCBOT_INT_IRCSERVER_H
 #define IRCBOT_INT_IRCSERVER_H
 
+#include <ircbot/hashtable.h>
 #include <ircbot/irccommand.h>
 #include <ircbot/ircserver.h>
 
 C_CLASS_DECL(Event);
+C_CLASS_DECL(IrcChannel);
 
 int IrcServer_connect(IrcServer *self) CMETHOD;
 void IrcServer_disconnect(IrcServer *self) CMETHOD;
@@ -16,12 +18,22 @@ int IrcServer_sendCmd(IrcServer *self, IrcCommand cmd,
 int IrcServer_sendMsg(IrcServer *self, const char *to,
 	const char *message, int action)
     CMETHOD ATTR_NONNULL((2)) ATTR_NONNULL((3));
+IBCaseMapping IrcServer_caseMapping(const IrcServer *self)
+    CMETHOD ATTR_PURE;
+const char *IrcServer_addMember(IrcServer *self, const char *nick,
+	IrcChannel *channel)
+    CMETHOD ATTR_NONNULL((2)) ATTR_NONNULL((3)) ATTR_RETNONNULL;
+void IrcServer_removeMember(IrcServer *self, const char *nick,
+	IrcChannel *channel)
+    CMETHOD ATTR_NONNULL((2)) ATTR_NONNULL((3));
 Event *IrcServer_connected(IrcServer *self)
     CMETHOD ATTR_RETNONNULL ATTR_PURE;
 Event *IrcServer_disconnected(IrcServer *self)
     CMETHOD ATTR_RETNONNULL ATTR_PURE;
 Event *IrcServer_msgReceived(IrcServer *self)
     CMETHOD ATTR_RETNONNULL ATTR_PURE;
+Event *IrcServer_batchReceived(IrcServer *self)
+    CMETHOD ATTR_RETNONNULL ATTR_PURE;
 Event *IrcServer_joined(IrcServer *self)
     CMETHOD ATTR_RETNONNULL ATTR_PURE;
 Event *IrcServer_parted(IrcServer *self)
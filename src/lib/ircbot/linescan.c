@@ -0,0 +1,107 @@
+#include "linescan.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define LINESCAN_X86
+#  include <immintrin.h>
+#endif
+
+/* Every scanner stores the offsets of all LF bytes directly preceded by a
+ * CR in buf[start..size), up to maxends of them, and returns how many were
+ * found. When the result equals maxends, the caller continues after the
+ * last offset. An LF at offset 0 never ends a line, the CR is unknown. */
+
+static size_t scanScalar(const uint8_t *buf, size_t start, size_t size,
+	size_t *ends, size_t maxends);
+#ifdef LINESCAN_X86
+static size_t scanSse2(const uint8_t *buf, size_t start, size_t size,
+	size_t *ends, size_t maxends) __attribute__((target("sse2")));
+static size_t scanAvx2(const uint8_t *buf, size_t start, size_t size,
+	size_t *ends, size_t maxends) __attribute__((target("avx2")));
+#endif
+
+static size_t scanScalar(const uint8_t *buf, size_t start, size_t size,
+	size_t *ends, size_t maxends)
+{
+    size_t n = 0;
+    while (start < size && n < maxends)
+    {
+	const uint8_t *lf = memchr(buf + start, '\n', size - start);
+	if (!lf) break;
+	size_t pos = lf - buf;
+	if (pos && buf[pos - 1] == '\r') ends[n++] = pos;
+	start = pos + 1;
+    }
+    return n;
+}
+
+#ifdef LINESCAN_X86
+/* compare a block of bytes against LF, and the same block shifted back by
+ * one byte against CR, so a set bit in both masks is a line end */
+
+static size_t scanSse2(const uint8_t *buf, size_t start, size_t size,
+	size_t *ends, size_t maxends)
+{
+    size_t n = 0;
+    size_t pos = start ? start : 1;
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+    for (; pos + 16 <= size; pos += 16)
+    {
+	__m128i cur = _mm_loadu_si128((const __m128i *)(buf + pos));
+	unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(cur, lf));
+	if (!mask) continue;
+	__m128i prev = _mm_loadu_si128((const __m128i *)(buf + pos - 1));
+	mask &= _mm_movemask_epi8(_mm_cmpeq_epi8(prev, cr));
+	while (mask)
+	{
+	    ends[n++] = pos + __builtin_ctz(mask);
+	    if (n == maxends) return n;
+	    mask &= mask - 1;
+	}
+    }
+    return n + scanScalar(buf, pos, size, ends + n, maxends - n);
+}
+
+static size_t scanAvx2(const uint8_t *buf, size_t start, size_t size,
+	size_t *ends, size_t maxends)
+{
+    size_t n = 0;
+    size_t pos = start ? start : 1;
+    const __m256i lf = _mm256_set1_epi8('\n');
+    const __m256i cr = _mm256_set1_epi8('\r');
+    for (; pos + 32 <= size; pos += 32)
+    {
+	__m256i cur = _mm256_loadu_si256((const __m256i *)(buf + pos));
+	uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(cur, lf));
+	if (!mask) continue;
+	__m256i prev = _mm256_loadu_si256((const __m256i *)(buf + pos - 1));
+	mask &= _mm256_movemask_epi8(_mm256_cmpeq_epi8(prev, cr));
+	while (mask)
+	{
+	    ends[n++] = pos + __builtin_ctz(mask);
+	    if (n == maxends) return n;
+	    mask &= mask - 1;
+	}
+    }
+    return n + scanSse2(buf, pos, size, ends + n, maxends - n);
+}
+#endif
+
+SOLOCAL size_t LineScan_ends(const uint8_t *buf, size_t start, size_t size,
+	size_t *ends, size_t maxends)
+{
+    if (!maxends) return 0;
+#ifdef LINESCAN_X86
+    if (__builtin_cpu_supports("avx2"))
+    {
+	return scanAvx2(buf, start, size, ends, maxends);
+    }
+    if (__builtin_cpu_supports("sse2"))
+    {
+	return scanSse2(buf, start, size, ends, maxends);
+    }
+#endif
+    return scanScalar(buf, start, size, ends, maxends);
+}
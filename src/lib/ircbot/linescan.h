@@ -0,0 +1,13 @@
+#ifndef IRCBOT_INT_LINESCAN_H
+#define IRCBOT_INT_LINESCAN_H
+
+#include <ircbot/decl.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+size_t LineScan_ends(const uint8_t *buf, size_t start, size_t size,
+	size_t *ends, size_t maxends)
+    ATTR_NONNULL((1)) ATTR_NONNULL((4));
+
+#endif
@@ -117,8 +117,13 @@ SOEXPORT void IBLog_msg(IBLogLevel level, const char *message)
 	lja->writer = currentwriter;
 	lja->writerdata = writerdata;
 	strcpy(lja->message, message);
-	ThreadJob *job = ThreadJob_create(logmsgJobProc, lja, 8);
-	ThreadPool_enqueue(job);
+	ThreadJob *job = ThreadJob_create(logmsgJobProc, lja, 8000);
+	if (ThreadPool_enqueue(job) != 0)
+	{
+	    ThreadJob_destroy(job);
+	    free(lja);
+	    currentwriter(level, message, writerdata);
+	}
     }
     else currentwriter(level, message, writerdata);
 }
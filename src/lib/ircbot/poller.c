@@ -0,0 +1,278 @@
+#define _DEFAULT_SOURCE
+
+#include <ircbot/log.h>
+
+#include "poller.h"
+#include "util.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#  define POLLER_EPOLL
+#  include <sys/epoll.h>
+#  include <unistd.h>
+#else
+#  include <sys/select.h>
+#  include <time.h>
+#endif
+
+#define FDCHUNKSIZE 64
+#define MAXEVENTS 64
+
+static uint8_t *fdevents;
+static int fdeventscapa;
+
+#ifdef POLLER_EPOLL
+static int epfd = -1;
+static struct epoll_event events[MAXEVENTS];
+#else
+static fd_set readfds;
+static fd_set writefds;
+static int nread;
+static int nwrite;
+static int nfds;
+static int initialized;
+#endif
+
+static void ensureCapa(int fd);
+static int updateEvents(int fd, unsigned oldev, unsigned newev);
+
+static void ensureCapa(int fd)
+{
+    if (fd < fdeventscapa) return;
+    int newcapa = fdeventscapa;
+    while (newcapa <= fd) newcapa += FDCHUNKSIZE;
+    fdevents = IB_xrealloc(fdevents, newcapa * sizeof *fdevents);
+    memset(fdevents + fdeventscapa, 0,
+	    (newcapa - fdeventscapa) * sizeof *fdevents);
+    fdeventscapa = newcapa;
+}
+
+#ifdef POLLER_EPOLL
+static int updateEvents(int fd, unsigned oldev, unsigned newev)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof ev);
+    ev.data.fd = fd;
+    if (newev & PE_READ) ev.events |= EPOLLIN;
+    if (newev & PE_WRITE) ev.events |= EPOLLOUT;
+    int op = !newev ? EPOLL_CTL_DEL : oldev ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    int rc = epoll_ctl(epfd, op, fd, &ev);
+    if (rc < 0)
+    {
+	/* a closed fd silently leaves the epoll set, so the number might
+	 * have been reused in the meantime */
+	if (op == EPOLL_CTL_MOD && errno == ENOENT)
+	{
+	    rc = epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+	}
+	else if (op == EPOLL_CTL_ADD && errno == EEXIST)
+	{
+	    rc = epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+	}
+	else if (op == EPOLL_CTL_DEL && (errno == ENOENT || errno == EBADF))
+	{
+	    rc = 0;
+	}
+    }
+    if (rc < 0)
+    {
+	IBLog_fmt(L_ERROR, "poller: cannot update events for fd %d", fd);
+    }
+    return rc;
+}
+#else
+static int updateEvents(int fd, unsigned oldev, unsigned newev)
+{
+    unsigned changed = oldev ^ newev;
+    if (changed & PE_READ)
+    {
+	if (newev & PE_READ)
+	{
+	    FD_SET(fd, &readfds);
+	    ++nread;
+	}
+	else
+	{
+	    FD_CLR(fd, &readfds);
+	    --nread;
+	}
+    }
+    if (changed & PE_WRITE)
+    {
+	if (newev & PE_WRITE)
+	{
+	    FD_SET(fd, &writefds);
+	    ++nwrite;
+	}
+	else
+	{
+	    FD_CLR(fd, &writefds);
+	    --nwrite;
+	}
+    }
+    if (newev)
+    {
+	if (fd >= nfds) nfds = fd+1;
+    }
+    else if (fd+1 >= nfds)
+    {
+	while (fd >= 0 && !fdevents[fd]) --fd;
+	nfds = fd+1;
+    }
+    return 0;
+}
+#endif
+
+SOLOCAL int Poller_init(void)
+{
+#ifdef POLLER_EPOLL
+    if (epfd >= 0) return -1;
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+    {
+	IBLog_msg(L_ERROR, "poller: cannot create epoll instance");
+	return -1;
+    }
+#else
+    if (initialized) return -1;
+    FD_ZERO(&readfds);
+    FD_ZERO(&writefds);
+    nread = 0;
+    nwrite = 0;
+    nfds = 0;
+    initialized = 1;
+#endif
+    return 0;
+}
+
+SOLOCAL const char *Poller_backend(void)
+{
+#ifdef POLLER_EPOLL
+    return "epoll";
+#else
+    return "pselect";
+#endif
+}
+
+SOLOCAL int Poller_register(int fd, unsigned events)
+{
+    if (fd < 0) return -1;
+#ifndef POLLER_EPOLL
+    if (fd >= FD_SETSIZE)
+    {
+	IBLog_fmt(L_ERROR, "poller: fd %d exceeds FD_SETSIZE", fd);
+	return -1;
+    }
+#endif
+    ensureCapa(fd);
+    unsigned oldev = fdevents[fd];
+    unsigned newev = oldev | events;
+    if (newev == oldev) return 0;
+    fdevents[fd] = newev;
+    if (updateEvents(fd, oldev, newev) < 0)
+    {
+	fdevents[fd] = oldev;
+	return -1;
+    }
+    return 0;
+}
+
+SOLOCAL void Poller_unregister(int fd, unsigned events)
+{
+    if (fd < 0 || fd >= fdeventscapa) return;
+    unsigned oldev = fdevents[fd];
+    unsigned newev = oldev & ~events;
+    if (newev == oldev) return;
+    fdevents[fd] = newev;
+    updateEvents(fd, oldev, newev);
+}
+
+SOLOCAL unsigned Poller_events(int fd)
+{
+    if (fd < 0 || fd >= fdeventscapa) return 0;
+    return fdevents[fd];
+}
+
+#ifdef POLLER_EPOLL
+SOLOCAL int Poller_wait(const sigset_t *sigmask, int timeout,
+	PollerHandler handler)
+{
+    int rc = epoll_pwait(epfd, events, MAXEVENTS, timeout, sigmask);
+    for (int i = 0; i < rc; ++i)
+    {
+	int fd = events[i].data.fd;
+	uint32_t ev = events[i].events;
+	unsigned ready = 0;
+	if (ev & (EPOLLIN|EPOLLERR|EPOLLHUP)) ready |= PE_READ;
+	if (ev & (EPOLLOUT|EPOLLERR|EPOLLHUP)) ready |= PE_WRITE;
+
+	/* an earlier handler of this batch might have unregistered */
+	ready &= Poller_events(fd);
+	if (ready) handler(fd, ready);
+    }
+    return rc;
+}
+#else
+SOLOCAL int Poller_wait(const sigset_t *sigmask, int timeout,
+	PollerHandler handler)
+{
+    fd_set rfds;
+    fd_set wfds;
+    fd_set *r = 0;
+    fd_set *w = 0;
+    if (nread)
+    {
+	memcpy(&rfds, &readfds, sizeof rfds);
+	r = &rfds;
+    }
+    if (nwrite)
+    {
+	memcpy(&wfds, &writefds, sizeof wfds);
+	w = &wfds;
+    }
+    struct timespec ts;
+    struct timespec *tsp = 0;
+    if (timeout >= 0)
+    {
+	ts.tv_sec = timeout / 1000;
+	ts.tv_nsec = 1000000L * (timeout % 1000);
+	tsp = &ts;
+    }
+    int rc = pselect(nfds, r, w, 0, tsp, sigmask);
+    int pending = rc;
+    for (int fd = 0; pending > 0 && fd < nfds; ++fd)
+    {
+	unsigned ready = 0;
+	if (r && FD_ISSET(fd, r))
+	{
+	    ready |= PE_READ;
+	    --pending;
+	}
+	if (w && FD_ISSET(fd, w))
+	{
+	    ready |= PE_WRITE;
+	    --pending;
+	}
+	ready &= Poller_events(fd);
+	if (ready) handler(fd, ready);
+    }
+    return rc;
+}
+#endif
+
+SOLOCAL void Poller_done(void)
+{
+#ifdef POLLER_EPOLL
+    if (epfd >= 0) close(epfd);
+    epfd = -1;
+#else
+    initialized = 0;
+#endif
+    free(fdevents);
+    fdevents = 0;
+    fdeventscapa = 0;
+}
@@ -0,0 +1,22 @@
+#ifndef IRCBOT_INT_POLLER_H
+#define IRCBOT_INT_POLLER_H
+
+#include <ircbot/decl.h>
+
+#include <signal.h>
+
+#define PE_READ 1U
+#define PE_WRITE 2U
+
+typedef void (*PollerHandler)(int fd, unsigned events);
+
+int Poller_init(void);
+const char *Poller_backend(void) ATTR_RETNONNULL ATTR_CONST;
+int Poller_register(int fd, unsigned events);
+void Poller_unregister(int fd, unsigned events);
+unsigned Poller_events(int fd) ATTR_PURE;
+int Poller_wait(const sigset_t *sigmask, int timeout, PollerHandler handler)
+    ATTR_NONNULL((1)) ATTR_NONNULL((3));
+void Poller_done(void);
+
+#endif
@@ -0,0 +1,358 @@
+#include <ircbot/hashtable.h>
+
+#include "sendqueue.h"
+#include "util.h"
+
+#include <stdlib.h>
+
+#define DEFBURST 4
+#define DEFMSPERLINE 2000
+#define SLABLINES 32
+#define MAXLINES 1024
+
+/* lines have a fixed size and are carved from slabs that are kept until
+ * the queue is destroyed, so queueing a line never calls malloc() once
+ * the slabs exist */
+typedef struct SendLine SendLine;
+struct SendLine
+{
+    SendLine *next;
+    uint16_t len;
+    uint8_t bulk;
+    char data[SENDLINEMAX + 1];
+};
+
+typedef struct SendSlab SendSlab;
+struct SendSlab
+{
+    SendSlab *next;
+    SendLine lines[SLABLINES];
+};
+
+/* lines waiting for one target, served in order. A target is in one of
+ * two rings, depending on whether its next line starts a message or
+ * continues one, and each ring is served round-robin */
+typedef struct TargetQueue TargetQueue;
+struct TargetQueue
+{
+    TargetQueue *prev;
+    TargetQueue *next;
+    SendLine *first;
+    SendLine *last;
+    char *name;
+};
+
+struct SendQueue
+{
+    SendLine *control;
+    SendLine *controlLast;
+    SendLine *final;
+    SendLine *finalLast;
+    IBHashTable *targets;
+    TargetQueue *rings[2];
+    SendSlab *slabs;
+    SendLine *freeLines;
+    size_t nLines;
+    size_t queued;
+    size_t maxQueued;
+    size_t allocFailed;
+    uint64_t lastFill;
+    int64_t budget;
+    unsigned burst;
+    unsigned msPerLine;
+};
+
+static void freeLine(SendQueue *self, SendLine *sl)
+    CMETHOD ATTR_NONNULL((2));
+static void appendLine(SendLine **first, SendLine **last, SendLine *sl)
+    ATTR_NONNULL((1)) ATTR_NONNULL((2)) ATTR_NONNULL((3));
+static void ringInsert(TargetQueue **ring, TargetQueue *tq)
+    ATTR_NONNULL((1)) ATTR_NONNULL((2));
+static void ringRemove(TargetQueue **ring, TargetQueue *tq)
+    ATTR_NONNULL((1)) ATTR_NONNULL((2));
+static SendLine *takeLine(SendQueue *self, int bulk) CMETHOD;
+static void clearLines(SendQueue *self, SendLine *sl) CMETHOD;
+static void clearRing(SendQueue *self, TargetQueue **ring)
+    CMETHOD ATTR_NONNULL((2));
+static void refill(SendQueue *self, uint64_t now) CMETHOD;
+
+SOLOCAL SendQueue *SendQueue_create(void)
+{
+    SendQueue *self = IB_xmalloc(sizeof *self);
+    self->control = 0;
+    self->controlLast = 0;
+    self->final = 0;
+    self->finalLast = 0;
+    self->targets = IBHashTable_create(4);
+    self->rings[0] = 0;
+    self->rings[1] = 0;
+    self->slabs = 0;
+    self->freeLines = 0;
+    self->nLines = 0;
+    self->queued = 0;
+    self->maxQueued = 0;
+    self->allocFailed = 0;
+    self->lastFill = 0;
+    self->burst = DEFBURST;
+    self->msPerLine = DEFMSPERLINE;
+    self->budget = (int64_t)self->burst * self->msPerLine;
+    return self;
+}
+
+SOLOCAL void SendQueue_setRate(SendQueue *self,
+	unsigned burst, unsigned msPerLine)
+{
+    self->burst = burst ? burst : 1;
+    self->msPerLine = msPerLine;
+    int64_t cap = (int64_t)self->burst * self->msPerLine;
+    if (self->budget > cap) self->budget = cap;
+}
+
+SOLOCAL void SendQueue_setCaseMapping(SendQueue *self, IBCaseMapping mapping)
+{
+    IBHashTable_setCaseMapping(self->targets, mapping);
+}
+
+SOLOCAL char *SendQueue_reserve(SendQueue *self, SendPriority prio)
+{
+    if (!self->freeLines)
+    {
+	/* control lines and QUIT are never dropped, they are few and
+	 * losing e.g. a PONG would cost the connection */
+	if (prio != SP_CONTROL && prio != SP_FINAL
+		&& self->nLines >= MAXLINES)
+	{
+	    ++self->allocFailed;
+	    return 0;
+	}
+	SendSlab *slab = IB_xmalloc(sizeof *slab);
+	slab->next = self->slabs;
+	self->slabs = slab;
+	for (int i = SLABLINES - 1; i >= 0; --i)
+	{
+	    slab->lines[i].next = self->freeLines;
+	    self->freeLines = slab->lines + i;
+	}
+	self->nLines += SLABLINES;
+    }
+    SendLine *sl = self->freeLines;
+    self->freeLines = sl->next;
+    sl->next = 0;
+    sl->len = 0;
+    return sl->data;
+}
+
+SOLOCAL void SendQueue_commit(SendQueue *self, SendPriority prio,
+	const char *target, char *line, size_t len)
+{
+    SendLine *sl = (SendLine *)(line - offsetof(SendLine, data));
+    if (len > SENDLINEMAX) len = SENDLINEMAX;
+    sl->len = len;
+    self->queued += len;
+    if (self->queued > self->maxQueued) self->maxQueued = self->queued;
+
+    if (prio == SP_CONTROL)
+    {
+	appendLine(&self->control, &self->controlLast, sl);
+	return;
+    }
+    if (prio == SP_FINAL)
+    {
+	appendLine(&self->final, &self->finalLast, sl);
+	return;
+    }
+
+    sl->bulk = prio == SP_BULK;
+    if (!target) target = "";
+    TargetQueue *tq = IBHashTable_get(self->targets, target);
+    if (!tq)
+    {
+	tq = IB_xmalloc(sizeof *tq);
+	tq->first = 0;
+	tq->last = 0;
+	tq->name = IB_copystr(target);
+	IBHashTable_set(self->targets, target, tq, 0);
+	ringInsert(self->rings + sl->bulk, tq);
+    }
+    appendLine(&tq->first, &tq->last, sl);
+}
+
+static void appendLine(SendLine **first, SendLine **last, SendLine *sl)
+{
+    if (*last) (*last)->next = sl;
+    else *first = sl;
+    *last = sl;
+}
+
+static void ringInsert(TargetQueue **ring, TargetQueue *tq)
+{
+    /* a target is served last in the current round */
+    if (*ring)
+    {
+	tq->next = *ring;
+	tq->prev = (*ring)->prev;
+	tq->prev->next = tq;
+	(*ring)->prev = tq;
+    }
+    else *ring = tq->next = tq->prev = tq;
+}
+
+static void ringRemove(TargetQueue **ring, TargetQueue *tq)
+{
+    if (tq->next == tq) *ring = 0;
+    else
+    {
+	tq->prev->next = tq->next;
+	tq->next->prev = tq->prev;
+	if (*ring == tq) *ring = tq->next;
+    }
+}
+
+static SendLine *takeLine(SendQueue *self, int bulk)
+{
+    TargetQueue **ring = self->rings + bulk;
+    TargetQueue *tq = *ring;
+    if (!tq) return 0;
+
+    SendLine *sl = tq->first;
+    if ((tq->first = sl->next))
+    {
+	if (tq->first->bulk == bulk) *ring = tq->next;
+	else
+	{
+	    ringRemove(ring, tq);
+	    ringInsert(self->rings + tq->first->bulk, tq);
+	}
+	return sl;
+    }
+
+    ringRemove(ring, tq);
+    IBHashTable_delete(self->targets, tq->name);
+    free(tq->name);
+    free(tq);
+    return sl;
+}
+
+static void refill(SendQueue *self, uint64_t now)
+{
+    int64_t cap = (int64_t)self->burst * self->msPerLine;
+    if (now > self->lastFill)
+    {
+	uint64_t elapsed = now - self->lastFill;
+	if (elapsed > (uint64_t)cap) self->budget = cap;
+	else self->budget += elapsed;
+    }
+    self->lastFill = now;
+    if (self->budget > cap) self->budget = cap;
+}
+
+SOLOCAL const char *SendQueue_next(SendQueue *self, uint64_t now,
+	uint16_t *len, unsigned *wait)
+{
+    refill(self, now);
+    *wait = 0;
+
+    SendLine *sl = self->control;
+    if (sl)
+    {
+	/* control lines don't wait for the budget, a PONG held back
+	 * behind replies could get the connection closed */
+	if (!(self->control = sl->next)) self->controlLast = 0;
+    }
+    else
+    {
+	if (!self->rings[0] && !self->rings[1] && !self->final) return 0;
+	if (self->budget < self->msPerLine)
+	{
+	    *wait = self->msPerLine - self->budget;
+	    return 0;
+	}
+	if (!(sl = takeLine(self, 0)) && !(sl = takeLine(self, 1)))
+	{
+	    sl = self->final;
+	    if (!(self->final = sl->next)) self->finalLast = 0;
+	}
+    }
+    self->budget -= self->msPerLine;
+    *len = sl->len;
+    return sl->data;
+}
+
+static void freeLine(SendQueue *self, SendLine *sl)
+{
+    self->queued -= sl->len;
+    sl->next = self->freeLines;
+    self->freeLines = sl;
+}
+
+SOLOCAL void SendQueue_release(SendQueue *self, const char *line)
+{
+    if (!line) return;
+    freeLine(self, (SendLine *)(line - offsetof(SendLine, data)));
+}
+
+SOLOCAL void SendQueue_stats(const SendQueue *self, IBSendStats *stats)
+{
+    stats->queued = self->queued;
+    stats->maxQueued = self->maxQueued;
+    stats->allocFailed = self->allocFailed;
+}
+
+SOLOCAL void SendQueue_fill(SendQueue *self, uint64_t now)
+{
+    self->budget = (int64_t)self->burst * self->msPerLine;
+    self->lastFill = now;
+}
+
+static void clearLines(SendQueue *self, SendLine *sl)
+{
+    while (sl)
+    {
+	SendLine *next = sl->next;
+	freeLine(self, sl);
+	sl = next;
+    }
+}
+
+static void clearRing(SendQueue *self, TargetQueue **ring)
+{
+    TargetQueue *tq = *ring;
+    if (!tq) return;
+    tq->prev->next = 0;
+    while (tq)
+    {
+	TargetQueue *next = tq->next;
+	clearLines(self, tq->first);
+	IBHashTable_delete(self->targets, tq->name);
+	free(tq->name);
+	free(tq);
+	tq = next;
+    }
+    *ring = 0;
+}
+
+SOLOCAL void SendQueue_clear(SendQueue *self)
+{
+    clearLines(self, self->control);
+    self->control = 0;
+    self->controlLast = 0;
+    clearLines(self, self->final);
+    self->final = 0;
+    self->finalLast = 0;
+    for (int i = 0; i < 2; ++i) clearRing(self, self->rings + i);
+}
+
+SOLOCAL void SendQueue_destroy(SendQueue *self)
+{
+    if (!self) return;
+    SendQueue_clear(self);
+    IBHashTable_destroy(self->targets);
+    SendSlab *slab = self->slabs;
+    while (slab)
+    {
+	SendSlab *next = slab->next;
+	free(slab);
+	slab = next;
+    }
+    free(self);
+}
@@ -0,0 +1,47 @@
+#ifndef IRCBOT_INT_SENDQUEUE_H
+#define IRCBOT_INT_SENDQUEUE_H
+
+#include <ircbot/decl.h>
+#include <ircbot/hashtable.h>
+#include <ircbot/ircserver.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+C_CLASS_DECL(SendQueue);
+
+/* maximum length of a line including CR/LF, line buffers have room for an
+ * additional terminating NUL */
+#define SENDLINEMAX 512
+
+/* lines for the same target are always sent in the order they were queued,
+ * the priority only decides which target is served next, and only control
+ * lines skip the rate limit */
+typedef enum SendPriority
+{
+    SP_CONTROL,	    /* keepalive and registration, e.g. PONG */
+    SP_REPLY,	    /* commands and the first line of a message */
+    SP_BULK,	    /* continuation lines of long messages */
+    SP_FINAL	    /* sent after everything else, i.e. QUIT */
+} SendPriority;
+
+SendQueue *SendQueue_create(void) ATTR_RETNONNULL;
+void SendQueue_setRate(SendQueue *self, unsigned burst, unsigned msPerLine)
+    CMETHOD;
+void SendQueue_setCaseMapping(SendQueue *self, IBCaseMapping mapping)
+    CMETHOD;
+char *SendQueue_reserve(SendQueue *self, SendPriority prio) CMETHOD;
+void SendQueue_commit(SendQueue *self, SendPriority prio,
+	const char *target, char *line, size_t len)
+    CMETHOD ATTR_NONNULL((4));
+const char *SendQueue_next(SendQueue *self, uint64_t now,
+	uint16_t *len, unsigned *wait)
+    CMETHOD ATTR_NONNULL((3)) ATTR_NONNULL((4));
+void SendQueue_release(SendQueue *self, const char *line) CMETHOD;
+void SendQueue_stats(const SendQueue *self, IBSendStats *stats)
+    CMETHOD ATTR_NONNULL((2));
+void SendQueue_fill(SendQueue *self, uint64_t now) CMETHOD;
+void SendQueue_clear(SendQueue *self) CMETHOD;
+void SendQueue_destroy(SendQueue *self);
+
+#endif
@@ -4,99 +4,81 @@
 
 #include "event.h"
 #include "ircbot.h"
+#include "poller.h"
 #include "service.h"
+#include "timer.h"
 
 #include <grp.h>
 #include <setjmp.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <string.h>
+#include <time.h>
+#include <errno.h>
 #include <sys/param.h>
-#include <sys/select.h>
-#include <sys/time.h>
 #include <unistd.h>
 
+#define SHUTDOWNTIMEOUT 5000
+
 static const DaemonOpts *opts;
 static Event *readyRead;
 static Event *readyWrite;
 static Event *startup;
 static Event *shutdown;
-static Event *tick;
 static Event *eventsDone;
 
-static fd_set readfds;
-static fd_set writefds;
-static int nread;
-static int nwrite;
-static int nfds;
 static int running;
 
 static volatile sig_atomic_t shutdownRequest;
-static volatile sig_atomic_t timerTick;
 
 static int shutdownRef;
-static int shutdownTicks;
-
-static struct itimerval timer;
-static struct itimerval otimer;
 
 static jmp_buf panicjmp;
 static PanicHandler panicHandlers[MAXPANICHANDLERS];
 static int numPanicHandlers;
 
 static void handlesig(int signum);
-static void tryReduceNfds(int id);
+static void fdReady(int fd, unsigned events);
+static void shutdownTimeout(void *receiver, Timer *timer);
 
 static void handlesig(int signum)
 {
-    if (signum == SIGALRM) timerTick = 1;
-    else shutdownRequest = 1;
+    (void)signum;
+    shutdownRequest = 1;
 }
 
-static void tryReduceNfds(int id)
+static void fdReady(int fd, unsigned events)
 {
-    if (!nread && !nwrite)
+    if (events & PE_WRITE) Event_raise(readyWrite, fd, 0);
+    if ((events & PE_READ) && (Poller_events(fd) & PE_READ))
     {
-	nfds = 0;
-    }
-    else if (id+1 >= nfds)
-    {
-	int fd;
-	for (fd = id; fd >= 0; --fd)
-	{
-	    if (FD_ISSET(fd, &readfds) || FD_ISSET(fd, &writefds))
-	    {
-		break;
-	    }
-	}
-	nfds = fd+1;
+	Event_raise(readyRead, fd, 0);
     }
 }
 
+static void shutdownTimeout(void *receiver, Timer *timer)
+{
+    (void)receiver;
+    (void)timer;
+
+    IBLog_msg(L_WARNING, "service: timeout waiting for clean shutdown");
+    shutdownRef = 0;
+}
+
 SOLOCAL int Service_init(const DaemonOpts *options)
 {
     if (opts) return -1;
+    if (Poller_init() < 0) return -1;
     opts = options;
-    readyRead = Event_create(0);
-    readyWrite = Event_create(0);
+    readyRead = Event_createKeyed(0);
+    readyWrite = Event_createKeyed(0);
     startup = Event_create(0);
     shutdown = Event_create(0);
-    tick = Event_create(0);
     eventsDone = Event_create(0);
-    FD_ZERO(&readfds);
-    FD_ZERO(&writefds);
-    nread = 0;
-    nwrite = 0;
-    nfds = 0;
     running = 0;
     shutdownRequest = 0;
-    timerTick = 0;
     shutdownRef = -1;
-    shutdownTicks = -1;
-    timer.it_interval.tv_sec = 0;
-    timer.it_interval.tv_usec = 0;
-    timer.it_value.tv_sec = 0;
-    timer.it_value.tv_usec = 0;
+    TimerWheel_init(Service_now());
     return 0;
 }
 
@@ -120,11 +102,6 @@ SOLOCAL Event *Service_shutdown(void)
     return shutdown;
 }
 
-SOLOCAL Event *Service_tick(void)
-{
-    return tick;
-}
-
 SOLOCAL Event *Service_eventsDone(void)
 {
     return eventsDone;
@@ -132,34 +109,22 @@ SOLOCAL Event *Service_eventsDone(void)
 
 SOLOCAL void Service_registerRead(int id)
 {
-    if (FD_ISSET(id, &readfds)) return;
-    FD_SET(id, &readfds);
-    ++nread;
-    if (id >= nfds) nfds = id+1;
+    Poller_register(id, PE_READ);
 }
 
 SOLOCAL void Service_unregisterRead(int id)
 {
-    if (!FD_ISSET(id, &readfds)) return;
-    FD_CLR(id, &readfds);
-    --nread;
-    tryReduceNfds(id);
+    Poller_unregister(id, PE_READ);
 }
 
 SOLOCAL void Service_registerWrite(int id)
 {
-    if (FD_ISSET(id, &writefds)) return;
-    FD_SET(id, &writefds);
-    ++nwrite;
-    if (id >= nfds) nfds = id+1;
+    Poller_register(id, PE_WRITE);
 }
 
 SOLOCAL void Service_unregisterWrite(int id)
 {
-    if (!FD_ISSET(id, &writefds)) return;
-    FD_CLR(id, &writefds);
-    --nwrite;
-    tryReduceNfds(id);
+    Poller_unregister(id, PE_WRITE);
 }
 
 SOLOCAL void Service_registerPanic(PanicHandler handler)
@@ -184,14 +149,24 @@ SOLOCAL void Service_unregisterPanic(PanicHandler handler)
     }
 }
 
-SOLOCAL int Service_setTickInterval(unsigned msec)
+SOLOCAL uint64_t Service_now(void)
 {
-    timer.it_interval.tv_sec = msec / 1000U;
-    timer.it_interval.tv_usec = 1000U * (msec % 1000U);
-    timer.it_value.tv_sec = msec / 1000U;
-    timer.it_value.tv_usec = 1000U * (msec % 1000U);
-    if (running) return setitimer(ITIMER_REAL, &timer, 0);
-    return 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000U + ts.tv_nsec / 1000000L;
+}
+
+SOLOCAL Timer *Service_addTimer(unsigned msec, int periodic,
+	void *receiver, TimerHandler handler)
+{
+    if (periodic && !msec) msec = 1;
+    return TimerWheel_add(Service_now() + msec, periodic ? msec : 0,
+	    receiver, handler);
+}
+
+SOLOCAL void Service_cancelTimer(Timer *timer)
+{
+    TimerWheel_cancel(timer);
 }
 
 SOLOCAL int Service_run(void)
@@ -227,7 +202,6 @@ SOLOCAL int Service_run(void)
     sigemptyset(&handler.sa_mask);
     sigaddset(&handler.sa_mask, SIGTERM);
     sigaddset(&handler.sa_mask, SIGINT);
-    sigaddset(&handler.sa_mask, SIGALRM);
     sigset_t mask;
 
     if (sigprocmask(SIG_BLOCK, &handler.sa_mask, &mask) < 0)
@@ -248,24 +222,13 @@ SOLOCAL int Service_run(void)
 	goto done;
     }
 
-    if (sigaction(SIGALRM, &handler, 0) < 0)
-    {
-	IBLog_msg(L_ERROR, "cannot set signal handler for SIGALRM");
-	goto done;
-    }
-
-    if (setitimer(ITIMER_REAL, &timer, &otimer) < 0)
-    {
-	IBLog_msg(L_ERROR, "cannot set periodic timer");
-	goto done;
-    }
-
     StartupEventArgs sea = { EXIT_SUCCESS };
     Event_raise(startup, 0, &sea);
     rc = sea.rc;
     if (rc != EXIT_SUCCESS) goto done;
 
     running = 1;
+    IBLog_fmt(L_DEBUG, "service: using %s backend", Poller_backend());
     IBLog_msg(L_INFO, "service started");
 
     if (setjmp(panicjmp) < 0) goto shutdown;
@@ -273,63 +236,27 @@ SOLOCAL int Service_run(void)
     while (shutdownRef != 0)
     {
 	Event_raise(eventsDone, 0, 0);
-	fd_set rfds;
-	fd_set wfds;
-	fd_set *r = 0;
-	fd_set *w = 0;
-	if (nread)
+	int src = 0;
+	if (!shutdownRequest)
 	{
-	    memcpy(&rfds, &readfds, sizeof rfds);
-	    r = &rfds;
+	    src = Poller_wait(&mask, TimerWheel_timeout(Service_now()),
+		    fdReady);
 	}
-	if (nwrite)
-	{
-	    memcpy(&wfds, &writefds, sizeof wfds);
-	    w = &wfds;
-	}
-	int src;
-	if (!shutdownRequest) src = pselect(nfds, r, w, 0, 0, &mask);
 	if (shutdownRequest)
 	{
 	    shutdownRequest = 0;
 	    shutdownRef = 0;
-	    shutdownTicks = 5;
+	    Service_addTimer(SHUTDOWNTIMEOUT, 0, 0, shutdownTimeout);
 	    Event_raise(shutdown, 0, 0);
 	    continue;
 	}
-	if (timerTick)
-	{
-	    timerTick = 0;
-	    if (shutdownTicks > 0 && !--shutdownTicks)
-	    {
-		shutdownRef = 0;
-		break;
-	    }
-	    Event_raise(tick, 0, 0);
-	    continue;
-	}
-	if (src < 0)
+	if (src < 0 && errno != EINTR)
 	{
-	    IBLog_msg(L_ERROR, "pselect() failed");
+	    IBLog_fmt(L_ERROR, "%s failed", Poller_backend());
 	    rc = EXIT_FAILURE;
 	    break;
 	}
-	if (w) for (int i = 0; src > 0 && i < nfds; ++i)
-	{
-	    if (FD_ISSET(i, w))
-	    {
-		--src;
-		Event_raise(readyWrite, i, 0);
-	    }
-	}
-	if (r) for (int i = 0; src > 0 && i < nfds; ++i)
-	{
-	    if (FD_ISSET(i, r))
-	    {
-		--src;
-		Event_raise(readyRead, i, 0);
-	    }
-	}
+	TimerWheel_run(Service_now());
     }
 
 shutdown:
@@ -343,12 +270,6 @@ done:
 	rc = EXIT_FAILURE;
     }
 
-    if (setitimer(ITIMER_REAL, &otimer, 0) < 0)
-    {
-	IBLog_msg(L_ERROR, "cannot restore original periodic timer");
-	rc = EXIT_FAILURE;
-    }
-
     return rc;
 }
 
@@ -359,7 +280,6 @@ SOLOCAL void Service_quit(void)
 
 SOLOCAL void Service_shutdownLock(void)
 {
-    if (shutdownRef == 0) Service_setTickInterval(1000);
     if (shutdownRef >= 0) ++shutdownRef;
 }
 
@@ -384,11 +304,12 @@ SOLOCAL void Service_done(void)
 {
     if (!opts) return;
     Event_destroy(eventsDone);
-    Event_destroy(tick);
     Event_destroy(shutdown);
     Event_destroy(startup);
     Event_destroy(readyWrite);
     Event_destroy(readyRead);
+    TimerWheel_done();
+    Poller_done();
     opts = 0;
     shutdown = 0;
     startup = 0;
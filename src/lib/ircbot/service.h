@@ -3,6 +3,10 @@
 
 #include <ircbot/decl.h>
 
+#include "timer.h"
+
+#include <stdint.h>
+
 #define MAXPANICHANDLERS 8
 
 C_CLASS_DECL(DaemonOpts);
@@ -20,7 +24,6 @@ Event *Service_readyRead(void) ATTR_RETNONNULL ATTR_PURE;
 Event *Service_readyWrite(void) ATTR_RETNONNULL ATTR_PURE;
 Event *Service_startup(void) ATTR_RETNONNULL ATTR_PURE;
 Event *Service_shutdown(void) ATTR_RETNONNULL ATTR_PURE;
-Event *Service_tick(void) ATTR_RETNONNULL ATTR_PURE;
 Event *Service_eventsDone(void) ATTR_RETNONNULL ATTR_PURE;
 void Service_registerRead(int id);
 void Service_unregisterRead(int id);
@@ -28,7 +31,11 @@ void Service_registerWrite(int id);
 void Service_unregisterWrite(int id);
 void Service_registerPanic(PanicHandler handler) ATTR_NONNULL((1));
 void Service_unregisterPanic(PanicHandler handler) ATTR_NONNULL((1));
-int Service_setTickInterval(unsigned msec);
+uint64_t Service_now(void);
+Timer *Service_addTimer(unsigned msec, int periodic,
+	void *receiver, TimerHandler handler)
+    ATTR_NONNULL((4)) ATTR_RETNONNULL;
+void Service_cancelTimer(Timer *timer);
 int Service_run(void);
 void Service_quit(void);
 void Service_shutdownLock(void);
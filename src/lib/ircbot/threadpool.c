@@ -1,5 +1,6 @@
 #define _DEFAULT_SOURCE
 
+#include <ircbot/hashtable.h>
 #include <ircbot/log.h>
 
 #include "event.h"
@@ -8,127 +9,537 @@
 #include "threadpool.h"
 #include "util.h"
 
+#include <errno.h>
 #include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
 #include <setjmp.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <threads.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#  define THREADPOOL_EVENTFD
+#  include <sys/eventfd.h>
+#else
+#  include <fcntl.h>
+#endif
+
+#define QUEUEALIGN 64
+#define BLOCKMAXWAIT 200
+
 struct ThreadJob
 {
     ThreadProc proc;
     void *arg;
     Event *finished;
+    Timer *timeout;
+    ThreadJob *next;
+    ThreadJobGroup *group;
+    char *key;
     const char *panicmsg;
+    atomic_int canceled;
     int hasCompleted;
-    int timeoutTicks;
+    int timeoutMs;
+};
+
+/* pending counts the unfinished children plus one reference held by the
+ * owner. The owner only drops it to wait, so only the child finishing last
+ * while the owner waits posts "done" */
+struct ThreadJobGroup
+{
+    atomic_int pending;
+    _Atomic(const char *) panicmsg;
+    ThreadJob *owner;
+    sem_t done;
 };
 
+/* work-stealing deque (Chase/Lev): the owning worker pushes and pops at
+ * the bottom, other workers steal from the top */
+typedef struct JobDeque
+{
+    _Atomic int64_t top;
+    char pad[QUEUEALIGN];
+    _Atomic int64_t bottom;
+    _Atomic(ThreadJob *) *jobs;
+    int64_t mask;
+} JobDeque;
+
 typedef struct Thread
 {
-    ThreadJob *job;
+    _Atomic(ThreadJob *) job;
     pthread_t handle;
-    pthread_mutex_t startlock;
-    pthread_mutex_t donelock;
-    pthread_cond_t start;
-    pthread_cond_t done;
-    int pipefd[2];
-    int failed;
-    int stoprq;
+    atomic_int failed;
+    JobDeque deque;
 } Thread;
 
+/* bounded MPMC queue (D. Vyukov): every cell carries a sequence number
+ * telling whether it is ready to be written or to be read in the current
+ * round, so producers and consumers only contend on their own position */
+typedef struct JobCell
+{
+    atomic_size_t seq;
+    ThreadJob *job;
+} JobCell;
+
 static Thread *threads;
-static ThreadJob **jobQueue;
-static pthread_mutex_t queuelock;
+static JobCell *jobQueue;
+static size_t queueMask;
+static _Alignas(QUEUEALIGN) atomic_size_t enqueuePos;
+static _Alignas(QUEUEALIGN) atomic_size_t dequeuePos;
+static _Alignas(QUEUEALIGN) sem_t jobsAvail;
+static atomic_int stoprq;
+static atomic_int idleWorkers;
 static int nthreads;
-static int queuesize;
-static int queueAvail;
-static int nextIdx;
-static int lastIdx;
+static int stealing;
+
+/* handling of a full queue, see IBOverloadPolicy */
+static IBOverloadPolicy policy;
+static pthread_mutex_t overflowLock = PTHREAD_MUTEX_INITIALIZER;
+static ThreadJob *overflowHead;
+static ThreadJob *overflowTail;
+static atomic_size_t overflowLen;
+static sem_t slotFree;
+static atomic_int blockedProducers;
+static pthread_mutex_t keyLock = PTHREAD_MUTEX_INITIALIZER;
+static IBHashTable *pendingKeys;
+
+static atomic_ulong nQueued;
+static atomic_ulong nRejected;
+static atomic_ulong nCoalesced;
+static atomic_ulong nBlocked;
+static atomic_ulong nRanInline;
+static atomic_ulong nOverflowed;
+static size_t maxOverflow;
+
+/* finished jobs are pushed on a lock-free stack and the service loop is
+ * woken through a single fd whenever the stack was empty */
+static _Alignas(QUEUEALIGN) _Atomic(ThreadJob *) doneJobs;
+static atomic_int threadFailed;
+static int donefd[2] = { -1, -1 };
 
 static thread_local int mainthread;
 static thread_local jmp_buf panicjmp;
 static thread_local const char *panicmsg;
-static thread_local volatile sig_atomic_t jobcanceled;
+static thread_local ThreadJob *currentJob;
+static thread_local Thread *currentThread;
+static thread_local uint32_t stealSeed;
 
-static Thread *availableThread(void);
-static void checkThreadJobs(void *receiver, void *sender, void *args);
+static void cancelJob(ThreadJob *job) ATTR_NONNULL((1));
+static void closeCompletion(void);
+static ThreadJob *dequePop(JobDeque *d) ATTR_NONNULL((1));
+static int dequePush(JobDeque *d, ThreadJob *job)
+    ATTR_NONNULL((1)) ATTR_NONNULL((2));
+static int dequeSteal(JobDeque *d, ThreadJob **job)
+    ATTR_NONNULL((1)) ATTR_NONNULL((2));
 static ThreadJob *dequeueJob(void);
 static int enqueueJob(ThreadJob *job) ATTR_NONNULL((1));
+static ThreadJob *findJob(Thread *t) ATTR_NONNULL((1));
+static void finishJob(ThreadJob *job) ATTR_NONNULL((1));
+static void freeThreads(void);
+static void jobTaken(ThreadJob *job) ATTR_NONNULL((1));
+static void jobTimeout(void *receiver, Timer *timer);
+static int openCompletion(void);
 static void panicHandler(const char *msg) ATTR_NONNULL((1));
-static void startThreadJob(Thread *t, ThreadJob *j)
-    ATTR_NONNULL((1)) ATTR_NONNULL((2));
+static void postDone(ThreadJob *job) ATTR_NONNULL((1));
+static void pushOverflow(ThreadJob *job) ATTR_NONNULL((1));
+static int queueJob(ThreadJob *job) ATTR_NONNULL((1));
+static void runJob(Thread *t, ThreadJob *job) ATTR_NONNULL((2));
+static void signalDone(void);
+static ThreadJob *stealJob(Thread *t) ATTR_NONNULL((1));
 static void stopThreads(int nthr);
+static ThreadJob *takeDone(void);
+static ThreadJob *takeJob(Thread *t) ATTR_NONNULL((1));
+static ThreadJob *takeQueued(void);
 static void threadJobDone(void *receiver, void *sender, void *args);
+static void wakeIdle(void);
 static void *worker(void *arg);
 static void workerInterrupt(int signum);
 
 static void workerInterrupt(int signum)
 {
+    /* only there to interrupt blocking calls, the job checks its own
+     * canceled flag */
     (void) signum;
-    jobcanceled = 1;
 }
 
-static void *worker(void *arg)
+static int enqueueJob(ThreadJob *job)
 {
-    Thread *t = arg;
-    t->failed = 0;
-    t->stoprq = 0;
-    if (pthread_mutex_lock(&t->startlock) < 0)
+    size_t pos = atomic_load_explicit(&enqueuePos, memory_order_relaxed);
+    for (;;)
     {
-	t->failed = 1;
-	write(t->pipefd[1], "1", 1);
-	return 0;
+	JobCell *cell = jobQueue + (pos & queueMask);
+	size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+	intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+	if (!diff)
+	{
+	    if (atomic_compare_exchange_weak_explicit(&enqueuePos, &pos,
+			pos + 1, memory_order_relaxed, memory_order_relaxed))
+	    {
+		cell->job = job;
+		atomic_store_explicit(&cell->seq, pos + 1,
+			memory_order_release);
+		sem_post(&jobsAvail);
+		return 0;
+	    }
+	}
+	else if (diff < 0) return -1;
+	else pos = atomic_load_explicit(&enqueuePos, memory_order_relaxed);
     }
+}
 
-    struct sigaction handler;
-    memset(&handler, 0, sizeof handler);
-    handler.sa_handler = workerInterrupt;
-    sigemptyset(&handler.sa_mask);
-    sigaddset(&handler.sa_mask, SIGUSR1);
+static ThreadJob *dequeueJob(void)
+{
+    size_t pos = atomic_load_explicit(&dequeuePos, memory_order_relaxed);
+    for (;;)
+    {
+	JobCell *cell = jobQueue + (pos & queueMask);
+	size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+	intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+	if (!diff)
+	{
+	    if (atomic_compare_exchange_weak_explicit(&dequeuePos, &pos,
+			pos + 1, memory_order_relaxed, memory_order_relaxed))
+	    {
+		ThreadJob *job = cell->job;
+		atomic_store_explicit(&cell->seq, pos + queueMask + 1,
+			memory_order_release);
+		return job;
+	    }
+	}
+	else if (diff < 0) return 0;
+	else pos = atomic_load_explicit(&dequeuePos, memory_order_relaxed);
+    }
+}
+
+static int dequePush(JobDeque *d, ThreadJob *job)
+{
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+    if (b - t > d->mask) return -1;
+    atomic_store_explicit(d->jobs + (b & d->mask), job, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    return 0;
+}
 
-    if (sigaction(SIGUSR1, &handler, 0) < 0)
+static ThreadJob *dequePop(JobDeque *d)
+{
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t t = atomic_load_explicit(&d->top, memory_order_relaxed);
+    if (t > b)
     {
-	t->failed = 1;
-	write(t->pipefd[1], "1", 1);
+	atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
 	return 0;
     }
+    ThreadJob *job = atomic_load_explicit(d->jobs + (b & d->mask),
+	    memory_order_relaxed);
+    if (t == b)
+    {
+	/* last job, race against thieves for it */
+	if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+		    memory_order_seq_cst, memory_order_relaxed)) job = 0;
+	atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    }
+    return job;
+}
 
-    if (pthread_sigmask(SIG_UNBLOCK, &handler.sa_mask, 0) < 0)
+static int dequeSteal(JobDeque *d, ThreadJob **job)
+{
+    int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if (t >= b) return 0;
+    *job = atomic_load_explicit(d->jobs + (t & d->mask),
+	    memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+		memory_order_seq_cst, memory_order_relaxed)) return -1;
+    return 1;
+}
+
+static ThreadJob *stealJob(Thread *t)
+{
+    int retry;
+    do
     {
-	t->failed = 1;
-	write(t->pipefd[1], "1", 1);
-	return 0;
+	retry = 0;
+	stealSeed ^= stealSeed << 13;
+	stealSeed ^= stealSeed >> 17;
+	stealSeed ^= stealSeed << 5;
+	int start = stealSeed % nthreads;
+	for (int i = 0; i < nthreads; ++i)
+	{
+	    Thread *victim = threads + (start + i) % nthreads;
+	    if (victim == t) continue;
+	    ThreadJob *job;
+	    int rc = dequeSteal(&victim->deque, &job);
+	    if (rc > 0) return job;
+	    if (rc < 0) retry = 1;
+	}
+    } while (retry);
+    return 0;
+}
+
+static void pushOverflow(ThreadJob *job)
+{
+    job->next = 0;
+    pthread_mutex_lock(&overflowLock);
+    if (overflowTail) overflowTail->next = job;
+    else overflowHead = job;
+    overflowTail = job;
+    size_t len = atomic_fetch_add(&overflowLen, 1) + 1;
+    if (len > maxOverflow) maxOverflow = len;
+    pthread_mutex_unlock(&overflowLock);
+    atomic_fetch_add_explicit(&nOverflowed, 1, memory_order_relaxed);
+    sem_post(&jobsAvail);
+}
+
+static void jobTaken(ThreadJob *job)
+{
+    if (job->key && pendingKeys)
+    {
+	pthread_mutex_lock(&keyLock);
+	IBHashTable_delete(pendingKeys, job->key);
+	pthread_mutex_unlock(&keyLock);
     }
+    if (policy == IBOP_BLOCK)
+    {
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&blockedProducers, memory_order_relaxed))
+	{
+	    sem_post(&slotFree);
+	}
+    }
+}
 
-    while (!t->stoprq)
+static ThreadJob *takeQueued(void)
+{
+    ThreadJob *job = dequeueJob();
+    if (!job && atomic_load(&overflowLen))
     {
-	jobcanceled = 0;
-	pthread_cond_wait(&t->start, &t->startlock);
-	if (t->stoprq) break;
-	if (!setjmp(panicjmp)) t->job->proc(t->job->arg);
-	else t->job->panicmsg = panicmsg;
-	write(t->pipefd[1], "0", 1);
-	pthread_mutex_lock(&t->donelock);
-	pthread_cond_signal(&t->done);
-	pthread_mutex_unlock(&t->donelock);
+	pthread_mutex_lock(&overflowLock);
+	if ((job = overflowHead))
+	{
+	    if (!(overflowHead = job->next)) overflowTail = 0;
+	    atomic_fetch_sub(&overflowLen, 1);
+	}
+	pthread_mutex_unlock(&overflowLock);
     }
+    if (job) jobTaken(job);
+    return job;
+}
+
+static ThreadJob *findJob(Thread *t)
+{
+    ThreadJob *job;
+    if ((job = dequePop(&t->deque))) return job;
+    if ((job = takeQueued())) return job;
+    return stealJob(t);
+}
+
+static void wakeIdle(void)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&idleWorkers, memory_order_relaxed))
+    {
+	sem_post(&jobsAvail);
+    }
+}
+
+static ThreadJob *takeJob(Thread *t)
+{
+    ThreadJob *job;
+    if (!stealing)
+    {
+	/* every post on the semaphore stands for one published job, but
+	 * the job at the head might still be in the middle of being
+	 * published */
+	while (sem_wait(&jobsAvail) < 0) ;
+	if (atomic_load(&stoprq)) return 0;
+	while (!(job = takeQueued())) sched_yield();
+	return job;
+    }
+
+    for (;;)
+    {
+	if (atomic_load(&stoprq)) return 0;
+	if ((job = findJob(t))) return job;
+
+	/* announce going idle before looking once more, so a job pushed
+	 * concurrently is either found here or wakes us up */
+	atomic_fetch_add(&idleWorkers, 1);
+	if (!(job = findJob(t))) while (sem_wait(&jobsAvail) < 0) ;
+	atomic_fetch_sub(&idleWorkers, 1);
+	if (job) return job;
+    }
+}
+
+static void runJob(Thread *t, ThreadJob *job)
+{
+    ThreadJob *outerJob = currentJob;
+    jmp_buf outerjmp;
+    memcpy(outerjmp, panicjmp, sizeof outerjmp);
 
-    pthread_mutex_unlock(&t->startlock);
+    if (job->group)
+    {
+	/* child jobs run on behalf of the job that created the group */
+	ThreadJobGroup *group = job->group;
+	currentJob = group->owner;
+	if (!currentJob || !atomic_load(&currentJob->canceled))
+	{
+	    if (!setjmp(panicjmp)) job->proc(job->arg);
+	    else
+	    {
+		const char *none = 0;
+		atomic_compare_exchange_strong(&group->panicmsg,
+			&none, panicmsg);
+	    }
+	}
+	memcpy(panicjmp, outerjmp, sizeof panicjmp);
+	currentJob = outerJob;
+	free(job);
+	if (atomic_fetch_sub_explicit(&group->pending, 1,
+		    memory_order_acq_rel) == 1)
+	{
+	    sem_post(&group->done);
+	}
+	return;
+    }
+
+    ThreadJob *outerRunning = atomic_load(&t->job);
+    currentJob = job;
+    atomic_store(&t->job, job);
+    if (!atomic_load(&job->canceled))
+    {
+	if (!setjmp(panicjmp)) job->proc(job->arg);
+	else job->panicmsg = panicmsg;
+    }
+    atomic_store(&t->job, outerRunning);
+    memcpy(panicjmp, outerjmp, sizeof panicjmp);
+    currentJob = outerJob;
+    postDone(job);
+}
+
+static int openCompletion(void)
+{
+#ifdef THREADPOOL_EVENTFD
+    donefd[0] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if (donefd[0] < 0) return -1;
+    donefd[1] = donefd[0];
+#else
+    if (pipe(donefd) < 0) return -1;
+    for (int i = 0; i < 2; ++i)
+    {
+	fcntl(donefd[i], F_SETFL, fcntl(donefd[i], F_GETFL) | O_NONBLOCK);
+	fcntl(donefd[i], F_SETFD, FD_CLOEXEC);
+    }
+#endif
+    return 0;
+}
+
+static void closeCompletion(void)
+{
+    if (donefd[0] < 0) return;
+    close(donefd[0]);
+    if (donefd[1] != donefd[0]) close(donefd[1]);
+    donefd[0] = -1;
+    donefd[1] = -1;
+}
+
+static void signalDone(void)
+{
+#ifdef THREADPOOL_EVENTFD
+    eventfd_write(donefd[1], 1);
+#else
+    /* a full pipe already guarantees a wakeup */
+    char c = 0;
+    write(donefd[1], &c, 1);
+#endif
+}
+
+static void postDone(ThreadJob *job)
+{
+    ThreadJob *head = atomic_load_explicit(&doneJobs, memory_order_relaxed);
+    do job->next = head;
+    while (!atomic_compare_exchange_weak_explicit(&doneJobs, &head, job,
+		memory_order_release, memory_order_relaxed));
+    if (!head) signalDone();
+}
+
+static ThreadJob *takeDone(void)
+{
+    /* reset the wakeup before taking the stack, so a job pushed after
+     * that will signal again */
+#ifdef THREADPOOL_EVENTFD
+    eventfd_t n;
+    eventfd_read(donefd[0], &n);
+#else
+    char buf[64];
+    while (read(donefd[0], buf, sizeof buf) > 0) ;
+#endif
+    ThreadJob *job = atomic_exchange_explicit(&doneJobs, 0,
+	    memory_order_acquire);
+
+    /* the stack is LIFO, reverse it to finish jobs in completion order */
+    ThreadJob *done = 0;
+    while (job)
+    {
+	ThreadJob *next = job->next;
+	job->next = done;
+	done = job;
+	job = next;
+    }
+    return done;
+}
+
+static void *worker(void *arg)
+{
+    Thread *t = arg;
+    atomic_store(&t->failed, 0);
+
+    struct sigaction handler;
+    memset(&handler, 0, sizeof handler);
+    handler.sa_handler = workerInterrupt;
+    sigemptyset(&handler.sa_mask);
+    sigaddset(&handler.sa_mask, SIGUSR1);
+
+    if (sigaction(SIGUSR1, &handler, 0) < 0
+	    || pthread_sigmask(SIG_UNBLOCK, &handler.sa_mask, 0) < 0)
+    {
+	atomic_store(&t->failed, 1);
+	atomic_store(&threadFailed, 1);
+	signalDone();
+	return 0;
+    }
+
+    currentThread = t;
+    stealSeed = (uint32_t)(t - threads) * 0x9e3779b9U + 1;
+    ThreadJob *job;
+    while ((job = takeJob(t))) runJob(t, job);
     return 0;
 }
 
 SOLOCAL ThreadJob *ThreadJob_create(
-	ThreadProc proc, void *arg, int timeoutTicks)
+	ThreadProc proc, void *arg, int timeoutMs)
 {
     ThreadJob *self = IB_xmalloc(sizeof *self);
     self->proc = proc;
     self->arg = arg;
     self->finished = Event_create(self);
+    self->timeout = 0;
+    self->next = 0;
+    self->group = 0;
+    self->key = 0;
     self->panicmsg = 0;
-    self->timeoutTicks = timeoutTicks;
+    atomic_init(&self->canceled, 0);
+    self->timeoutMs = timeoutMs;
     self->hasCompleted = 1;
     return self;
 }
@@ -143,150 +554,205 @@ SOLOCAL int ThreadJob_hasCompleted(const ThreadJob *self)
     return self->hasCompleted;
 }
 
+SOLOCAL void ThreadJob_setKey(ThreadJob *self, const char *key)
+{
+    free(self->key);
+    self->key = IB_copystr(key);
+}
+
 SOLOCAL void ThreadJob_destroy(ThreadJob *self)
 {
     if (!self) return;
+    Service_cancelTimer(self->timeout);
     Event_destroy(self->finished);
+    free(self->key);
     free(self);
 }
 
 SOLOCAL int ThreadJob_canceled(void)
 {
-    return (int)jobcanceled;
+    return currentJob && atomic_load(&currentJob->canceled);
 }
 
-static void stopThreads(int nthr)
+SOLOCAL ThreadJobGroup *ThreadJobGroup_create(void)
 {
-    for (int i = 0; i < nthr; ++i)
+    ThreadJobGroup *self = IB_xmalloc(sizeof *self);
+    atomic_init(&self->pending, 1);
+    atomic_init(&self->panicmsg, 0);
+    self->owner = currentJob;
+    if (sem_init(&self->done, 0, 0) < 0)
     {
-	if (pthread_kill(threads[i].handle, 0) >= 0)
-	{
-	    if (threads[i].job)
-	    {
-		threads[i].stoprq = 1;
-		pthread_kill(threads[i].handle, SIGUSR1);
-		pthread_cond_wait(&threads[i].done, &threads[i].donelock);
-		pthread_mutex_unlock(&threads[i].donelock);
-	    }
-	    else
-	    {
-		pthread_mutex_lock(&threads[i].startlock);
-		threads[i].stoprq = 1;
-		pthread_cond_signal(&threads[i].start);
-		pthread_mutex_unlock(&threads[i].startlock);
-	    }
-	}
-	pthread_join(threads[i].handle, 0);
-	close(threads[i].pipefd[0]);
-	close(threads[i].pipefd[1]);
-	pthread_cond_destroy(&threads[i].done);
-	pthread_mutex_destroy(&threads[i].donelock);
-	pthread_cond_destroy(&threads[i].start);
-	pthread_mutex_destroy(&threads[i].startlock);
+	Service_panic("threadpool: can't create job group semaphore");
     }
+    return self;
 }
 
-static int enqueueJob(ThreadJob *job)
+SOLOCAL void ThreadJobGroup_spawn(ThreadJobGroup *self,
+	ThreadProc proc, void *arg)
 {
-    int rc = -1;
-    pthread_mutex_lock(&queuelock);
-    if (!queueAvail) goto done;
-    rc = 0;
-    jobQueue[nextIdx++] = job;
-    --queueAvail;
-    if (nextIdx == queuesize) nextIdx = 0;
-done:
-    pthread_mutex_unlock(&queuelock);
-    return rc;
+    ThreadJob *job = IB_xmalloc(sizeof *job);
+    job->proc = proc;
+    job->arg = arg;
+    job->finished = 0;
+    job->timeout = 0;
+    job->next = 0;
+    job->group = self;
+    job->key = 0;
+    job->panicmsg = 0;
+    atomic_init(&job->canceled, 0);
+    job->hasCompleted = 1;
+    job->timeoutMs = 0;
+    atomic_fetch_add_explicit(&self->pending, 1, memory_order_relaxed);
+
+    Thread *t = currentThread;
+    if (stealing && t && dequePush(&t->deque, job) == 0) wakeIdle();
+    else runJob(t, job);
 }
 
-static ThreadJob *dequeueJob(void)
+SOLOCAL void ThreadJobGroup_wait(ThreadJobGroup *self)
 {
-    ThreadJob *job = 0;
-    pthread_mutex_lock(&queuelock);
-    while (!job)
+    Thread *t = currentThread;
+    while (atomic_load_explicit(&self->pending, memory_order_acquire) > 1)
     {
-	if (queueAvail == queuesize) break;
-	job = jobQueue[lastIdx];
-	jobQueue[lastIdx++] = 0;
-	++queueAvail;
-	if (lastIdx == queuesize) lastIdx = 0;
+	/* help with queued jobs instead of just blocking the thread, the
+	 * own deque holds the most recently spawned children */
+	ThreadJob *job = 0;
+	if (stealing && t && !(job = dequePop(&t->deque))) job = stealJob(t);
+	if (!job) break;
+	runJob(t, job);
     }
-    pthread_mutex_unlock(&queuelock);
-    return job;
+
+    /* the remaining children run elsewhere, e.g. waiting for I/O, so
+     * sleep until the last one finishes */
+    if (atomic_fetch_sub_explicit(&self->pending, 1,
+		memory_order_acq_rel) != 1)
+    {
+	while (sem_wait(&self->done) < 0) ;
+    }
+    atomic_store_explicit(&self->pending, 1, memory_order_relaxed);
+    const char *msg = atomic_exchange(&self->panicmsg, 0);
+    if (msg) Service_panic(msg);
 }
 
-static Thread *availableThread(void)
+SOLOCAL void ThreadJobGroup_destroy(ThreadJobGroup *self)
 {
-    for (int i = 0; i < nthreads; ++i)
+    if (!self) return;
+    ThreadJobGroup_wait(self);
+    sem_destroy(&self->done);
+    free(self);
+}
+
+static void stopThreads(int nthr)
+{
+    atomic_store(&stoprq, 1);
+    sem_post(&slotFree);
+    for (int i = 0; i < nthr; ++i)
     {
-	if (!threads[i].job) return threads+i;
+	sem_post(&jobsAvail);
+	ThreadJob *job = atomic_load(&threads[i].job);
+	if (job) cancelJob(job);
     }
-    return 0;
+    for (int i = 0; i < nthr; ++i)
+    {
+	pthread_join(threads[i].handle, 0);
+    }
+
+    /* jobs queued by workers for themselves */
+    ThreadJob *job;
+    if (stealing) for (int i = 0; i < nthr; ++i)
+    {
+	while ((job = dequePop(&threads[i].deque))) ThreadJob_destroy(job);
+    }
+
+    /* finished jobs not yet picked up by the service loop */
+    job = takeDone();
+    while (job)
+    {
+	ThreadJob *next = job->next;
+	ThreadJob_destroy(job);
+	job = next;
+    }
+    Service_unregisterRead(donefd[0]);
+    Event_unregister(Service_readyRead(), 0, threadJobDone, donefd[0]);
+    closeCompletion();
+    sem_destroy(&slotFree);
+    sem_destroy(&jobsAvail);
 }
 
-static void startThreadJob(Thread *t, ThreadJob *j)
+static void freeThreads(void)
 {
-    pthread_mutex_lock(&t->startlock);
-    t->job = j;
-    pthread_cond_signal(&t->start);
-    pthread_mutex_lock(&t->donelock);
-    pthread_mutex_unlock(&t->startlock);
+    for (int i = 0; i < nthreads; ++i) free(threads[i].deque.jobs);
+    free(threads);
+    threads = 0;
 }
 
-static void threadJobDone(void *receiver, void *sender, void *args)
+static void cancelJob(ThreadJob *job)
 {
-    (void)sender;
-    (void)args;
-
-    Thread *t = receiver;
-    char buf[2];
-    read(t->pipefd[0], buf, sizeof buf);
-    if (t->failed)
+    job->hasCompleted = 0;
+    atomic_store(&job->canceled, 1);
+    for (int i = 0; i < nthreads; ++i)
     {
-	pthread_join(t->handle, 0);
-	IBLog_msg(L_WARNING, "threadpool: restarting failed thread");
-	if (pthread_create(&t->handle, 0, worker, t) < 0)
+	if (atomic_load(&threads[i].job) == job)
 	{
-	    IBLog_msg(L_FATAL, "threadpool: error restarting thread");
-	    Service_quit();
+	    pthread_kill(threads[i].handle, SIGUSR1);
+	    return;
 	}
-	return;
     }
-    pthread_cond_wait(&t->done, &t->donelock);
-    if (t->job->panicmsg)
+}
+
+static void finishJob(ThreadJob *job)
+{
+    Service_cancelTimer(job->timeout);
+    job->timeout = 0;
+    if (job->panicmsg)
     {
-	const char *msg = t->job->panicmsg;
-	ThreadJob_destroy(t->job);
-	t->job = 0;
-	pthread_mutex_unlock(&t->donelock);
+	const char *msg = job->panicmsg;
+	ThreadJob_destroy(job);
 	Service_panic(msg);
     }
-    Event_raise(t->job->finished, 0, t->job->arg);
-    ThreadJob_destroy(t->job);
-    t->job = 0;
-    pthread_mutex_unlock(&t->donelock);
-    ThreadJob *next = dequeueJob();
-    if (next) startThreadJob(t, next);
+    Event_raise(job->finished, 0, job->arg);
+    ThreadJob_destroy(job);
 }
 
-static void checkThreadJobs(void *receiver, void *sender, void *args)
+static void threadJobDone(void *receiver, void *sender, void *args)
 {
-    (void)receiver;
     (void)sender;
     (void)args;
 
+    (void)receiver;
+
+    ThreadJob *job = takeDone();
+    while (job)
+    {
+	ThreadJob *next = job->next;
+	finishJob(job);
+	job = next;
+    }
+
+    if (!atomic_exchange(&threadFailed, 0)) return;
     for (int i = 0; i < nthreads; ++i)
     {
-	if (threads[i].job && threads[i].job->timeoutTicks
-		&& !--threads[i].job->timeoutTicks)
+	Thread *t = threads + i;
+	if (!atomic_exchange(&t->failed, 0)) continue;
+	pthread_join(t->handle, 0);
+	IBLog_msg(L_WARNING, "threadpool: restarting failed thread");
+	if (pthread_create(&t->handle, 0, worker, t) < 0)
 	{
-	    pthread_kill(threads[i].handle, SIGUSR1);
-	    threads[i].job->hasCompleted = 0;
+	    IBLog_msg(L_FATAL, "threadpool: error restarting thread");
+	    Service_quit();
 	}
     }
 }
 
+static void jobTimeout(void *receiver, Timer *timer)
+{
+    (void)timer;
+
+    ThreadJob *job = receiver;
+    job->timeout = 0;
+    cancelJob(job);
+}
+
 static void panicHandler(const char *msg)
 {
     if (!threads || mainthread) return;
@@ -300,6 +766,7 @@ SOLOCAL int ThreadPool_init(const IBThreadOpts *opts)
     sigset_t mask;
     sigfillset(&blockmask);
     int rc = -1;
+    int queuesize;
     
     if (threads) return rc;
 
@@ -341,78 +808,83 @@ SOLOCAL int ThreadPool_init(const IBThreadOpts *opts)
     }
     else queuesize = opts->maxQueueLen;
 
+    /* the queue needs a power of 2 for its sequence numbers */
+    size_t qsize = 2;
+    while (qsize < (size_t)queuesize) qsize <<= 1;
+
     IBLog_fmt(L_DEBUG, "threadpool: starting with %d threads and a queue for "
-	    "%d jobs", nthreads, queuesize);
+	    "%zu jobs", nthreads, qsize);
 
     threads = IB_xmalloc(nthreads * sizeof *threads);
     memset(threads, 0, nthreads * sizeof *threads);
-    jobQueue = IB_xmalloc(queuesize * sizeof *jobQueue);
-    memset(jobQueue, 0, queuesize * sizeof *jobQueue);
+    jobQueue = IB_xmalloc(qsize * sizeof *jobQueue);
+    for (size_t i = 0; i < qsize; ++i)
+    {
+	atomic_init(&jobQueue[i].seq, i);
+	jobQueue[i].job = 0;
+    }
+    queueMask = qsize - 1;
+    atomic_store(&enqueuePos, 0);
+    atomic_store(&dequeuePos, 0);
+    stealing = opts->workStealing;
+    policy = opts->overloadPolicy;
+    overflowHead = 0;
+    overflowTail = 0;
+    atomic_store(&overflowLen, 0);
+    atomic_store(&blockedProducers, 0);
+    atomic_store(&nQueued, 0);
+    atomic_store(&nRejected, 0);
+    atomic_store(&nCoalesced, 0);
+    atomic_store(&nBlocked, 0);
+    atomic_store(&nRanInline, 0);
+    atomic_store(&nOverflowed, 0);
+    maxOverflow = 0;
+    atomic_store(&stoprq, 0);
+    atomic_store(&idleWorkers, 0);
+    atomic_store(&doneJobs, 0);
+    atomic_store(&threadFailed, 0);
+    if (sem_init(&jobsAvail, 0, 0) < 0)
+    {
+	IBLog_msg(L_ERROR, "threadpool: error creating semaphore");
+	goto done;
+    }
+    if (sem_init(&slotFree, 0, 0) < 0)
+    {
+	IBLog_msg(L_ERROR, "threadpool: error creating semaphore");
+	sem_destroy(&jobsAvail);
+	goto done;
+    }
+    if (openCompletion() < 0)
+    {
+	IBLog_msg(L_ERROR, "threadpool: error creating completion fd");
+	sem_destroy(&slotFree);
+	sem_destroy(&jobsAvail);
+	goto done;
+    }
+    if (policy == IBOP_COALESCE) pendingKeys = IBHashTable_create(6);
+    Event_register(Service_readyRead(), 0, threadJobDone, donefd[0]);
+    Service_registerRead(donefd[0]);
 
     for (int i = 0; i < nthreads; ++i)
     {
-	if (pthread_mutex_init(&threads[i].startlock, 0) < 0)
-	{
-	    IBLog_msg(L_ERROR, "threadpool: error creating mutex");
-	    goto rollback;
-	}
-	if (pthread_cond_init(&threads[i].start, 0) < 0)
-	{
-	    IBLog_msg(L_ERROR, "threadpool: error creating condition variable");
-	    goto rollback_startlock;
-	}
-	if (pthread_mutex_init(&threads[i].donelock, 0) < 0)
+	atomic_init(&threads[i].job, 0);
+	atomic_init(&threads[i].failed, 0);
+	if (stealing)
 	{
-	    IBLog_msg(L_ERROR, "threadpool: error creating mutex");
-	    goto rollback_start;
+	    JobDeque *d = &threads[i].deque;
+	    atomic_init(&d->top, 0);
+	    atomic_init(&d->bottom, 0);
+	    d->jobs = IB_xmalloc(qsize * sizeof *d->jobs);
+	    d->mask = queueMask;
 	}
-	if (pthread_cond_init(&threads[i].done, 0) < 0)
-	{
-	    IBLog_msg(L_ERROR, "threadpool: error creating condition variable");
-	    goto rollback_donelock;
-	}
-	if (pipe(threads[i].pipefd) < 0)
-	{
-	    IBLog_msg(L_ERROR, "threadpool: error creating pipe");
-	    goto rollback_done;
-	}
-	Event_register(Service_readyRead(), threads+i, threadJobDone,
-		threads[i].pipefd[0]);
 	if (pthread_create(&threads[i].handle, 0, worker, threads+i) < 0)
 	{
 	    IBLog_msg(L_ERROR, "threadpool: error creating thread");
-	    Event_unregister(Service_readyRead(), threads+i, threadJobDone,
-		    threads[i].pipefd[0]);
-	    goto rollback_pipe;
+	    stopThreads(i);
+	    goto done;
 	}
-	Service_registerRead(threads[i].pipefd[0]);
-	continue;
-
-rollback_pipe:
-	close(threads[i].pipefd[0]);
-	close(threads[i].pipefd[1]);
-rollback_done:
-	pthread_cond_destroy(&threads[i].done);
-rollback_donelock:
-	pthread_mutex_destroy(&threads[i].donelock);
-rollback_start:
-	pthread_cond_destroy(&threads[i].start);
-rollback_startlock:
-	pthread_mutex_destroy(&threads[i].startlock);
-rollback:
-	stopThreads(i);
-	goto done;
     }
     rc = 0;
-    Event_register(Service_tick(), 0, checkThreadJobs, 0);
-    queueAvail = queuesize;
-    nextIdx = 0;
-    lastIdx = 0;
-    if (pthread_mutex_init(&queuelock, 0) < 0)
-    {
-	stopThreads(nthreads);
-	rc = -1;
-    }
 
 done:
     if (sigprocmask(SIG_SETMASK, &mask, 0) < 0)
@@ -429,11 +901,11 @@ done:
     }
     else
     {
-	free(threads);
-	threads = 0;
+	freeThreads();
+	IBHashTable_destroy(pendingKeys);
+	pendingKeys = 0;
 	free(jobQueue);
 	jobQueue = 0;
-	queueAvail = 0;
     }
 
     return rc;
@@ -446,61 +918,158 @@ SOLOCAL int ThreadPool_active(void)
 
 SOLOCAL int ThreadPool_enqueue(ThreadJob *job)
 {
-    if (mainthread && threads)
+    if (!threads) return -1;
+
+    /* timers belong to the service loop, so only jobs from the main thread
+     * get a timeout, counting from the time they are queued */
+    if (mainthread && job->timeoutMs > 0)
     {
-	Thread *t = availableThread();
-	if (t)
-	{
-	    startThreadJob(t, job);
-	    return 0;
-	}
+	job->timeout = Service_addTimer(job->timeoutMs, 0, job, jobTimeout);
+    }
+    /* workers queue jobs for themselves, other workers can steal them */
+    if (stealing && currentThread
+	    && dequePush(&currentThread->deque, job) == 0)
+    {
+	atomic_fetch_add_explicit(&nQueued, 1, memory_order_relaxed);
+	wakeIdle();
+	return 0;
     }
-    return enqueueJob(job);
+    int rc = queueJob(job);
+    if (rc != 0)
+    {
+	Service_cancelTimer(job->timeout);
+	job->timeout = 0;
+    }
+    return rc;
 }
 
-SOLOCAL void ThreadPool_cancel(ThreadJob *job)
+static int queueJob(ThreadJob *job)
 {
-    if (threads)
+    switch (policy)
     {
-	for (int i = 0; i < nthreads; ++i)
-	{
-	    if (threads[i].job == job)
+	case IBOP_GROW:
+	    /* once jobs overflow, keep their order until all are taken */
+	    if (atomic_load(&overflowLen) || enqueueJob(job) < 0)
 	    {
-		pthread_kill(threads[i].handle, SIGUSR1);
-		threads[i].job->hasCompleted = 0;
-		return;
+		pushOverflow(job);
 	    }
-	}
-    }
-    if (queueAvail != queuesize)
-    {
-	int i = lastIdx;
-	do
-	{
-	    if (jobQueue[i] == job)
+	    goto queued;
+
+	case IBOP_BLOCK:
+	    if (enqueueJob(job) == 0) goto queued;
+	    if (currentThread)
+	    {
+		/* a worker waiting for other workers could stall the whole
+		 * pool, so it runs the job itself */
+		atomic_fetch_add_explicit(&nRanInline, 1, memory_order_relaxed);
+		runJob(currentThread, job);
+		return 0;
+	    }
+	    if (mainthread && atomic_load(&overflowLen))
+	    {
+		/* the service loop already gave up waiting, keep the order */
+		pushOverflow(job);
+		goto queued;
+	    }
+	    atomic_fetch_add_explicit(&nBlocked, 1, memory_order_relaxed);
+	    atomic_fetch_add(&blockedProducers, 1);
+	    atomic_thread_fence(memory_order_seq_cst);
+	    int rc;
+	    struct timespec deadline;
+	    if (mainthread)
+	    {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += BLOCKMAXWAIT * 1000000L;
+		deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+		deadline.tv_nsec %= 1000000000L;
+	    }
+	    while ((rc = enqueueJob(job)) < 0 && !atomic_load(&stoprq))
+	    {
+		if (!mainthread)
+		{
+		    while (sem_wait(&slotFree) < 0) ;
+		    continue;
+		}
+		/* job timeouts are fired by the service loop, so it must not
+		 * wait for hung workers forever */
+		while ((rc = sem_timedwait(&slotFree, &deadline)) < 0
+			&& errno == EINTR) ;
+		if (rc < 0) break;
+	    }
+	    atomic_fetch_sub(&blockedProducers, 1);
+	    if (rc == 0) goto queued;
+	    if (mainthread && !atomic_load(&stoprq))
 	    {
-		job->hasCompleted = 0;
-		Event_raise(job->finished, 0, job->arg);
-		ThreadJob_destroy(job);
-		jobQueue[i] = 0;
-		return;
+		pushOverflow(job);
+		goto queued;
 	    }
-	    if (++i == queuesize) i = 0;
-	} while ( i != nextIdx);
+	    break;
+
+	case IBOP_COALESCE:
+	    if (job->key)
+	    {
+		pthread_mutex_lock(&keyLock);
+		int waiting = !!IBHashTable_get(pendingKeys, job->key);
+		if (!waiting) IBHashTable_set(pendingKeys, job->key, job, 0);
+		pthread_mutex_unlock(&keyLock);
+		if (waiting)
+		{
+		    atomic_fetch_add_explicit(&nCoalesced, 1,
+			    memory_order_relaxed);
+		    return 1;
+		}
+	    }
+	    if (enqueueJob(job) == 0) goto queued;
+	    if (job->key)
+	    {
+		pthread_mutex_lock(&keyLock);
+		IBHashTable_delete(pendingKeys, job->key);
+		pthread_mutex_unlock(&keyLock);
+	    }
+	    break;
+
+	default:
+	    if (enqueueJob(job) == 0) goto queued;
     }
+    atomic_fetch_add_explicit(&nRejected, 1, memory_order_relaxed);
+    return -1;
+
+queued:
+    atomic_fetch_add_explicit(&nQueued, 1, memory_order_relaxed);
+    return 0;
+}
+
+SOLOCAL void ThreadPool_stats(IBThreadStats *stats)
+{
+    stats->queued = atomic_load(&nQueued);
+    stats->rejected = atomic_load(&nRejected);
+    stats->coalesced = atomic_load(&nCoalesced);
+    stats->blocked = atomic_load(&nBlocked);
+    stats->ranInline = atomic_load(&nRanInline);
+    stats->overflowed = atomic_load(&nOverflowed);
+    pthread_mutex_lock(&overflowLock);
+    stats->overflowLen = atomic_load(&overflowLen);
+    stats->maxOverflowLen = maxOverflow;
+    pthread_mutex_unlock(&overflowLock);
+}
+
+SOLOCAL void ThreadPool_cancel(ThreadJob *job)
+{
+    if (threads) cancelJob(job);
 }
 
 SOLOCAL void ThreadPool_done(void)
 {
     if (!threads) return;
     stopThreads(nthreads);
-    free(threads);
-    threads = 0;
-    pthread_mutex_destroy(&queuelock);
-    for (int i = 0; i < queuesize; ++i) ThreadJob_destroy(jobQueue[i]);
+    freeThreads();
+    ThreadJob *job;
+    while ((job = takeQueued())) ThreadJob_destroy(job);
+    IBHashTable_destroy(pendingKeys);
+    pendingKeys = 0;
     free(jobQueue);
     jobQueue = 0;
-    queueAvail = 0;
     Service_unregisterPanic(panicHandler);
     mainthread = 0;
+    stealing = 0;
 }
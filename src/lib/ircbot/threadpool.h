@@ -5,20 +5,31 @@
 
 C_CLASS_DECL(Event);
 C_CLASS_DECL(ThreadJob);
+C_CLASS_DECL(ThreadJobGroup);
 C_CLASS_DECL(IBThreadOpts);
+C_CLASS_DECL(IBThreadStats);
 
 typedef void (*ThreadProc)(void *arg);
 
-ThreadJob *ThreadJob_create(ThreadProc proc, void *arg, int timeoutTicks)
+ThreadJob *ThreadJob_create(ThreadProc proc, void *arg, int timeoutMs)
     ATTR_NONNULL((1)) ATTR_RETNONNULL;
 Event *ThreadJob_finished(ThreadJob *self) CMETHOD ATTR_RETNONNULL ATTR_PURE;
 int ThreadJob_hasCompleted(const ThreadJob *self) CMETHOD ATTR_PURE;
+void ThreadJob_setKey(ThreadJob *self, const char *key)
+    CMETHOD ATTR_NONNULL((2));
 void ThreadJob_destroy(ThreadJob *self);
 int ThreadJob_canceled(void);
 
+ThreadJobGroup *ThreadJobGroup_create(void) ATTR_RETNONNULL;
+void ThreadJobGroup_spawn(ThreadJobGroup *self, ThreadProc proc, void *arg)
+    CMETHOD ATTR_NONNULL((2));
+void ThreadJobGroup_wait(ThreadJobGroup *self) CMETHOD;
+void ThreadJobGroup_destroy(ThreadJobGroup *self);
+
 int ThreadPool_init(const IBThreadOpts *opts) ATTR_NONNULL((1));
 int ThreadPool_active(void);
 int ThreadPool_enqueue(ThreadJob *job) ATTR_NONNULL((1));
+void ThreadPool_stats(IBThreadStats *stats) ATTR_NONNULL((1));
 void ThreadPool_cancel(ThreadJob *job) ATTR_NONNULL((1));
 void ThreadPool_done(void);
 
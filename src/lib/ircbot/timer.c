@@ -0,0 +1,238 @@
+#include "timer.h"
+#include "util.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* hierarchical timing wheel with millisecond ticks: level 0 covers the
+ * next 64ms, every further level 64 times the range of the previous one,
+ * so 4 levels reach about 4.6 hours. Timers further away are parked in
+ * the last slot reachable and re-cascaded from there. */
+
+#define TWBITS 6
+#define TWSIZE (1U << TWBITS)
+#define TWMASK (TWSIZE - 1)
+#define TWLEVELS 4
+#define TWMAXDELTA ((1ULL << (TWLEVELS * TWBITS)) - 1)
+#define TWDETACHED 0xffU
+
+struct Timer
+{
+    Timer *next;
+    Timer **pprev;
+    void *receiver;
+    TimerHandler handler;
+    uint64_t expires;
+    unsigned interval;
+    uint8_t level;
+    uint8_t slot;
+    uint8_t canceled;
+};
+
+typedef struct TimerLevel
+{
+    uint64_t occupied;
+    Timer *slots[TWSIZE];
+} TimerLevel;
+
+static TimerLevel levels[TWLEVELS];
+static uint64_t base;
+static Timer *firing;
+
+static void linkTimer(Timer *t, Timer **head);
+static void unlinkTimer(Timer *t);
+static void insert(Timer *t);
+static unsigned cascade(unsigned level);
+static void fire(Timer *t, uint64_t now);
+
+static void linkTimer(Timer *t, Timer **head)
+{
+    t->next = *head;
+    if (t->next) t->next->pprev = &t->next;
+    t->pprev = head;
+    *head = t;
+}
+
+static void unlinkTimer(Timer *t)
+{
+    *t->pprev = t->next;
+    if (t->next) t->next->pprev = t->pprev;
+    if (t->level < TWLEVELS && !levels[t->level].slots[t->slot])
+    {
+	levels[t->level].occupied &= ~(1ULL << t->slot);
+    }
+    t->next = 0;
+    t->pprev = 0;
+}
+
+static void insert(Timer *t)
+{
+    uint64_t when = t->expires < base ? base : t->expires;
+    uint64_t delta = when - base;
+    unsigned level = 0;
+    if (delta > TWMAXDELTA)
+    {
+	when = base + TWMAXDELTA;
+	delta = TWMAXDELTA;
+    }
+    while (delta >= (1ULL << ((level + 1) * TWBITS))) ++level;
+    t->level = level;
+    t->slot = (when >> (level * TWBITS)) & TWMASK;
+    linkTimer(t, levels[level].slots + t->slot);
+    levels[level].occupied |= 1ULL << t->slot;
+}
+
+static unsigned cascade(unsigned level)
+{
+    unsigned idx = (base >> (level * TWBITS)) & TWMASK;
+    Timer *list = levels[level].slots[idx];
+    levels[level].slots[idx] = 0;
+    levels[level].occupied &= ~(1ULL << idx);
+    while (list)
+    {
+	Timer *t = list;
+	list = t->next;
+	insert(t);
+    }
+    return idx;
+}
+
+static void fire(Timer *t, uint64_t now)
+{
+    firing = t;
+    t->handler(t->receiver, t);
+    firing = 0;
+    if (t->canceled || !t->interval)
+    {
+	free(t);
+	return;
+    }
+    t->expires += t->interval;
+    if (t->expires <= now) t->expires = now + t->interval;
+    insert(t);
+}
+
+SOLOCAL void TimerWheel_init(uint64_t now)
+{
+    memset(levels, 0, sizeof levels);
+    base = now;
+    firing = 0;
+}
+
+SOLOCAL Timer *TimerWheel_add(uint64_t expires, unsigned interval,
+	void *receiver, TimerHandler handler)
+{
+    Timer *self = IB_xmalloc(sizeof *self);
+    self->receiver = receiver;
+    self->handler = handler;
+    self->expires = expires;
+    self->interval = interval;
+    self->canceled = 0;
+    insert(self);
+    return self;
+}
+
+SOLOCAL void TimerWheel_cancel(Timer *timer)
+{
+    if (!timer) return;
+    if (timer == firing)
+    {
+	timer->canceled = 1;
+	return;
+    }
+    unlinkTimer(timer);
+    free(timer);
+}
+
+SOLOCAL void TimerWheel_run(uint64_t now)
+{
+    while (base <= now)
+    {
+	unsigned idx = base & TWMASK;
+	if (!idx)
+	{
+	    for (unsigned level = 1; level < TWLEVELS; ++level)
+	    {
+		if (cascade(level)) break;
+	    }
+	}
+
+	Timer *pending = 0;
+	if (levels[0].occupied & (1ULL << idx))
+	{
+	    pending = levels[0].slots[idx];
+	    pending->pprev = &pending;
+	    levels[0].slots[idx] = 0;
+	    levels[0].occupied &= ~(1ULL << idx);
+	    for (Timer *t = pending; t; t = t->next) t->level = TWDETACHED;
+	}
+
+	/* skip ahead to the next occupied slot, but never across the next
+	 * cascading point */
+	uint64_t ahead = idx == TWMASK ? 0 : levels[0].occupied >> (idx + 1);
+	uint64_t next = ahead ? base + 1 + (uint64_t)__builtin_ctzll(ahead)
+	    : (base | TWMASK) + 1;
+	base = next > now + 1 ? now + 1 : next;
+
+	Timer *t;
+	while ((t = pending))
+	{
+	    unlinkTimer(t);
+	    fire(t, now);
+	}
+    }
+}
+
+SOLOCAL int TimerWheel_timeout(uint64_t now)
+{
+    uint64_t next = UINT64_MAX;
+    for (unsigned level = 0; level < TWLEVELS; ++level)
+    {
+	uint64_t occ = levels[level].occupied;
+	if (!occ) continue;
+	unsigned shift = level * TWBITS;
+	unsigned idx = (base >> shift) & TWMASK;
+	uint64_t rotation = (base >> (shift + TWBITS)) << (shift + TWBITS);
+
+	/* the slot at base is still due unless base already moved past its
+	 * cascading point, then it can only hold the next rotation */
+	uint64_t ahead;
+	if (!(base & ((1ULL << shift) - 1))) ahead = occ & (~0ULL << idx);
+	else ahead = idx == TWMASK ? 0 : occ & (~0ULL << (idx + 1));
+	uint64_t when;
+	if (ahead)
+	{
+	    when = rotation + ((uint64_t)__builtin_ctzll(ahead) << shift);
+	}
+	else
+	{
+	    when = rotation + (1ULL << (shift + TWBITS))
+		+ ((uint64_t)__builtin_ctzll(occ) << shift);
+	}
+	if (when < next) next = when;
+    }
+    if (next == UINT64_MAX) return -1;
+    if (next <= now) return 0;
+    if (next - now > INT_MAX) return INT_MAX;
+    return next - now;
+}
+
+SOLOCAL void TimerWheel_done(void)
+{
+    for (unsigned level = 0; level < TWLEVELS; ++level)
+    {
+	for (unsigned slot = 0; slot < TWSIZE; ++slot)
+	{
+	    Timer *t = levels[level].slots[slot];
+	    while (t)
+	    {
+		Timer *next = t->next;
+		free(t);
+		t = next;
+	    }
+	    levels[level].slots[slot] = 0;
+	}
+	levels[level].occupied = 0;
+    }
+}
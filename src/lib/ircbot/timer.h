@@ -0,0 +1,21 @@
+#ifndef IRCBOT_INT_TIMER_H
+#define IRCBOT_INT_TIMER_H
+
+#include <ircbot/decl.h>
+
+#include <stdint.h>
+
+C_CLASS_DECL(Timer);
+
+typedef void (*TimerHandler)(void *receiver, Timer *timer);
+
+void TimerWheel_init(uint64_t now);
+Timer *TimerWheel_add(uint64_t expires, unsigned interval,
+	void *receiver, TimerHandler handler)
+    ATTR_NONNULL((4)) ATTR_RETNONNULL;
+void TimerWheel_cancel(Timer *timer);
+void TimerWheel_run(uint64_t now);
+int TimerWheel_timeout(uint64_t now) ATTR_PURE;
+void TimerWheel_done(void);
+
+#endif
@@ -5,6 +5,25 @@
 #include "service.h"
 #include "util.h"
 
+/* fold tables for all case mappings, mapping upper case to lower case
+ * between 'A' and the given last character */
+#define CMFOLD(c, last) ((c) >= 'A' && (c) <= (last) ? (c) + 0x20 : (c))
+#define CMFOLD4(c, last) CMFOLD((c), (last)), CMFOLD((c) + 1, (last)), \
+    CMFOLD((c) + 2, (last)), CMFOLD((c) + 3, (last))
+#define CMFOLD16(c, last) CMFOLD4((c), (last)), CMFOLD4((c) + 4, (last)), \
+    CMFOLD4((c) + 8, (last)), CMFOLD4((c) + 12, (last))
+#define CMFOLD64(c, last) CMFOLD16((c), (last)), CMFOLD16((c) + 16, (last)), \
+    CMFOLD16((c) + 32, (last)), CMFOLD16((c) + 48, (last))
+#define CMFOLD256(last) { CMFOLD64(0, (last)), CMFOLD64(64, (last)), \
+    CMFOLD64(128, (last)), CMFOLD64(192, (last)) }
+
+static const uint8_t casefold[][256] = {
+    [IBCM_NONE] = CMFOLD256(0),
+    [IBCM_ASCII] = CMFOLD256('Z'),
+    [IBCM_RFC1459] = CMFOLD256('^'),
+    [IBCM_STRICTRFC1459] = CMFOLD256(']')
+};
+
 DECLEXPORT void *IB_xmalloc(size_t size)
 {
     void *m = malloc(size);
@@ -70,14 +89,40 @@ DECLEXPORT char *IB_joinstr(const char *delim, char **strings)
     return joined;
 }
 
-SOLOCAL uint8_t hashstr(const char *key, uint8_t mask)
+SOLOCAL uint32_t hashstr(const char *key, IBCaseMapping mapping)
 {
-    size_t h = 5381;
+    const uint8_t *fold = casefold[mapping];
+    uint32_t h = 2166136261U;
     while (*key)
     {
-	h += (h << 5) + ((uint8_t)*key++);
+	h ^= fold[(uint8_t)*key++];
+	h *= 16777619U;
+    }
+    return h;
+}
+
+SOLOCAL int strcmpmap(const char *s1, const char *s2, IBCaseMapping mapping)
+{
+    if (mapping == IBCM_NONE) return strcmp(s1, s2);
+    const uint8_t *fold = casefold[mapping];
+    const uint8_t *p1 = (const uint8_t *)s1;
+    const uint8_t *p2 = (const uint8_t *)s2;
+    while (*p1 && fold[*p1] == fold[*p2]) ++p1, ++p2;
+    return fold[*p1] - fold[*p2];
+}
+
+SOLOCAL int strncmpmap(const char *s1, const char *s2, size_t n,
+	IBCaseMapping mapping)
+{
+    if (mapping == IBCM_NONE) return strncmp(s1, s2, n);
+    const uint8_t *fold = casefold[mapping];
+    const uint8_t *p1 = (const uint8_t *)s1;
+    const uint8_t *p2 = (const uint8_t *)s2;
+    for (; n; --n, ++p1, ++p2)
+    {
+	if (!*p1 || fold[*p1] != fold[*p2]) return fold[*p1] - fold[*p2];
     }
-    return h & mask;
+    return 0;
 }
 
 SOLOCAL void appendchr(char **str, size_t *size, size_t *pos,